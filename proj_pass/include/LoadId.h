@@ -0,0 +1,41 @@
+/*
+  Stable load identifiers and function checksums shared by the stride
+  profiler and the profile loader
+*/
+
+#ifndef LOADID_H
+#define LOADID_H
+
+#include "llvm/Module.h"
+#include "llvm/Function.h"
+#include "llvm/Instruction.h"
+#include <map>
+
+namespace llvm {
+
+  // Assigns every load of F an id that survives edits elsewhere in the
+  // module. The id hashes the function name with the load's debug location
+  // (line relative to the start of the function, column and the ordinal
+  // among loads sharing that location). Without debug info the ordinal of
+  // the load within the function is used instead. Must be called before F
+  // is instrumented so both passes see the same instruction order.
+  void computeStableLoadIds(Function &F, std::map<Instruction*, unsigned int> &ids);
+
+  // computeStableLoadIds over every defined function of M, keeping only
+  // ids that identify a single load. Every load whose hash collides with
+  // another load of the module (and any load hashing to one of the two
+  // ids DenseMap reserves) is left out, so the profiler, the sampler's
+  // site list and the loader all skip exactly the same loads.
+  void computeModuleLoadIds(Module &M, std::map<Instruction*, unsigned int> &ids);
+
+  // Hash of the function name, identifies F in the profile's checksum table.
+  unsigned int getFunctionId(Function &F);
+
+  // Checksum of the CFG of F (block successors and instruction opcodes,
+  // not debug locations). Profile entries of a function are only applied
+  // while its checksum matches the one recorded at instrumentation time.
+  unsigned int computeFunctionChecksum(Function &F);
+
+}
+
+#endif
@@ -0,0 +1,20 @@
+/*
+  Compile-time stride detection for loads with an affine address
+*/
+
+#ifndef STATICSTRIDE_H
+#define STATICSTRIDE_H
+
+#include "llvm/Instructions.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+
+namespace llvm {
+
+  // Returns true and sets stride (in bytes) when the address of the load is
+  // an affine recurrence of its innermost loop with a constant, non-zero step.
+  bool getStaticStride(ScalarEvolution *SE, LoopInfo *LI, Instruction *inst, long &stride);
+
+}
+
+#endif
@@ -16,6 +16,8 @@
 #include "llvm/Support/Debug.h"
 #include "llvm/Target/TargetData.h"
 #include "llvm/ADT/IndexedMap.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Support/Allocator.h"
 #include "llvm/Module.h"
 #include "profilefeedback.h"
 #include <map>
@@ -32,24 +34,40 @@ namespace llvm {
 
   ModulePass *createStrideLoadProfilePass();
 
+  // The stride profile of a load travels with the IR as !stride.prof:
+  // !{i32 load_id, i32 num_strides, i32 exec_count, i32 num_zero_diff,
+  //   i32 dominant_stride, !{i64 top_freqs...}, !{i64 stride, i64 count, ...},
+  //   !{i64 bucket, i64 count, ...}, !{i64 line_stride, i64 count, ...},
+  //   !{i64 delta, i64 next_delta, i64 count, ...},
+  //   !{i64 accesses, i64 misses, ...}}
+  void setStrideProfMetadata(Instruction *inst, const loadInfo &info);
+
+  // Decodes the !stride.prof of inst into info, false if there is none.
+  bool getStrideProfMetadata(const Instruction *inst, loadInfo &info);
+
   class StrideLoadProfile : public ModulePass {
   public:
-    std::map<unsigned int, Instruction*> IdToInstMap;   // Inst* -> InstId
-    std::map<Instruction*, unsigned int> InstToIdMap;   // InstID -> Inst*
-    std::map<std::pair<Instruction*, Instruction*>*, unsigned int> DepToTimesMap; 
-    std::map<BasicBlock*, std::set<std::pair<Instruction*, Instruction*>* > > LoopToDepSetMap;
-    std::map<BasicBlock*, unsigned int> LoopToMaxDepTimesMap;
+    std::vector<Instruction*> IdToInstMap;              // InstID -> Inst*
+    DenseMap<Instruction*, unsigned int> InstToIdMap;   // Inst* -> InstId
+
+    DenseMap<unsigned int, Instruction *> LoadIdToLoadInst; // stable load id -> load
+    DenseMap<Instruction *, loadInfo *> LoadToLoadInfo;
 
-    std::map<unsigned int, Instruction *> LoadIdToLoadInst;
-    std::map<Instruction *, loadInfo *> LoadToLoadInfo;
+    // functions whose CFG checksum differs from the profiled build
+    std::set<Function *> StaleFunctions;
 
-    static unsigned int stride_id;
-    static unsigned int load_id;
     static char ID;
     StrideLoadProfile() : ModulePass (ID) {}
 
+    // every loadInfo handed out lives in the arena and is freed with it
+    loadInfo *createLoadInfo();
+
     virtual bool runOnModule (Module &M);
     virtual void getAnalysisUsage(AnalysisUsage &AU) const;
+    virtual void releaseMemory();
+
+  private:
+    SpecificBumpPtrAllocator<loadInfo> LoadInfoArena;
   };
 }
 #endif 
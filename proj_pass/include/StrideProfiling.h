@@ -8,6 +8,7 @@ namespace llvm {
   class LoopPass;
 
   ModulePass *createStrideInitPass();
+  ModulePass *createStrideSitesPass();
   ModulePass* createLdStCallCounter();
   FunctionPass *createStrideProfilerPass();
 
@@ -31,13 +31,24 @@
 #define WSSTD_T 0.10
 #define MAXPREFETCHDISTANCE 4
 #define NUM_TOP_FREQ 4
+#define PMST_PHASE_STRIDES 4 // profiled strides a PMST phase may lock on to
+#define MISS_T 0.02          // min simulated L1 miss ratio worth a prefetch
+#define MARKOV_T 0.05       // min share of strides a delta correlation must explain
+#define MARKOV_ENTRIES 8     // delta correlations embedded per load
 #define MEMORY_LATENCY 200 // approximate value for mem latency
 
 using namespace llvm;
 using namespace std;
 
+// the stride that most often followed delta, see STRIDE_CORRELATION
+struct deltaCorrelation {
+    long delta;
+    long next_delta;
+    long count;
+};
+
 struct loadInfo {
-    int load_id;            // the id for the load
+    unsigned int load_id;   // the stable id for the load (see LoadId.h)
     int num_strides;        // number of unique stride values
     int exec_count;         // counts the total number of strides analyzed
     int num_zero_diff;      // frequency of a stride of 0
@@ -45,6 +56,13 @@ struct loadInfo {
     int profiled_stride;    // ? TODO
     int trip_count;         // calculated later in second pass
     vector<long> top_freqs; // top X frequencies for the top stride vlaues
+
+    // full stride distribution, empty for profiles without it
+    vector< pair<long, long> > top_strides;      // <stride, count>, most frequent first
+    map<int, long> stride_histogram;             // log2 bucket of the other strides -> count
+    vector< pair<long, long> > top_line_strides; // <stride in cache lines, count>
+    vector<deltaCorrelation> delta_correlations; // most frequent first
+    vector< pair<long, long> > cache_misses;     // <accesses, misses> L1..LLC, then <LLC misses, cold>
 };
 
 void profile(Instruction *inst);
@@ -0,0 +1,138 @@
+/*
+  Stable load identifiers: a profile collected on an older build still maps
+  onto the right loads as long as the function containing them is unchanged
+*/
+
+#include "llvm/Module.h"
+#include "llvm/Function.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/BasicBlock.h"
+#include "llvm/Instructions.h"
+#include "llvm/Support/DebugLoc.h"
+#include "llvm/Support/CFG.h"
+#include <map>
+#include <set>
+#include <utility>
+#include "LoadId.h"
+
+using namespace llvm;
+
+namespace {
+  // 32 bit FNV-1a
+  const unsigned int FNV_OFFSET = 2166136261U;
+  const unsigned int FNV_PRIME = 16777619U;
+
+  unsigned int hashBytes(unsigned int hash, const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+      hash ^= (unsigned char) data[i];
+      hash *= FNV_PRIME;
+    }
+    return hash;
+  }
+
+  unsigned int hashInt(unsigned int hash, unsigned int value) {
+    for (int i = 0; i < 4; i++) {
+      hash ^= (value >> (i * 8)) & 0xff;
+      hash *= FNV_PRIME;
+    }
+    return hash;
+  }
+}
+
+unsigned int llvm::getFunctionId(Function &F) {
+  const std::string name = F.getName().str();
+  return hashBytes(FNV_OFFSET, name.data(), name.size());
+}
+
+unsigned int llvm::computeFunctionChecksum(Function &F) {
+  std::map<BasicBlock*, unsigned int> blockIndex;
+  unsigned int index = 0;
+  for (Function::iterator BB = F.begin(), BE = F.end(); BB != BE; ++BB) {
+    blockIndex[BB] = index++;
+  }
+
+  unsigned int hash = hashInt(FNV_OFFSET, index);
+  for (Function::iterator BB = F.begin(), BE = F.end(); BB != BE; ++BB) {
+    hash = hashInt(hash, BB->size());
+    for (BasicBlock::iterator I = BB->begin(), IE = BB->end(); I != IE; ++I) {
+      hash = hashInt(hash, I->getOpcode());
+    }
+    for (succ_iterator SI = succ_begin(BB), SE = succ_end(BB); SI != SE; ++SI) {
+      hash = hashInt(hash, blockIndex[*SI]);
+    }
+  }
+  return hash;
+}
+
+void llvm::computeStableLoadIds(Function &F, std::map<Instruction*, unsigned int> &ids) {
+  const unsigned int fn_hash = getFunctionId(F);
+
+  // line numbers are taken relative to the first located instruction so
+  // that edits above the function do not shift them
+  unsigned int first_line = 0;
+  bool found_line = false;
+  for (Function::iterator BB = F.begin(), BE = F.end(); BB != BE && !found_line; ++BB) {
+    for (BasicBlock::iterator I = BB->begin(), IE = BB->end(); I != IE; ++I) {
+      if (!I->getDebugLoc().isUnknown()) {
+        first_line = I->getDebugLoc().getLine();
+        found_line = true;
+        break;
+      }
+    }
+  }
+
+  std::map<std::pair<unsigned int, unsigned int>, unsigned int> seen_locations;
+  unsigned int ordinal = 0;
+  for (Function::iterator BB = F.begin(), BE = F.end(); BB != BE; ++BB) {
+    for (BasicBlock::iterator I = BB->begin(), IE = BB->end(); I != IE; ++I) {
+      if (!isa<LoadInst>(I)) {
+        continue;
+      }
+
+      unsigned int hash = fn_hash;
+      const DebugLoc &DL = I->getDebugLoc();
+      if (DL.isUnknown()) {
+        hash = hashInt(hash, 0);
+        hash = hashInt(hash, ordinal);
+      } else {
+        const unsigned int line = DL.getLine() - first_line;
+        const unsigned int col = DL.getCol();
+        unsigned int &dup = seen_locations[std::make_pair(line, col)];
+        hash = hashInt(hash, 1);
+        hash = hashInt(hash, line);
+        hash = hashInt(hash, col);
+        hash = hashInt(hash, dup++);
+      }
+
+      ids[I] = hash;
+      ordinal++;
+    }
+  }
+}
+
+void llvm::computeModuleLoadIds(Module &M, std::map<Instruction*, unsigned int> &ids) {
+  std::map<Instruction*, unsigned int> all;
+  for (Module::iterator IF = M.begin(), E = M.end(); IF != E; ++IF) {
+    if (!IF->isDeclaration()) {
+      computeStableLoadIds(*IF, all);
+    }
+  }
+
+  std::map<unsigned int, unsigned int> uses;
+  for (std::map<Instruction*, unsigned int>::iterator I = all.begin(), E = all.end(); I != E; ++I) {
+    uses[I->second]++;
+  }
+
+  unsigned int dropped = 0;
+  for (std::map<Instruction*, unsigned int>::iterator I = all.begin(), E = all.end(); I != E; ++I) {
+    if (uses[I->second] > 1 || I->second >= ~0U - 1) {
+      dropped++;
+      continue;
+    }
+    ids.insert(*I);
+  }
+
+  if (dropped > 0) {
+    errs() << dropped << " loads share a load id with another load and are not profiled\n";
+  }
+}
@@ -0,0 +1,42 @@
+/*
+  Classify loads whose address is an affine function of the loop induction
+  variable (e.g. A[i][j]) without running the stride profiler
+*/
+
+#include "llvm/Instructions.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "StaticStride.h"
+
+using namespace llvm;
+
+bool llvm::getStaticStride(ScalarEvolution *SE, LoopInfo *LI, Instruction *inst, long &stride) {
+  LoadInst *load = dyn_cast<LoadInst>(inst);
+  if (load == NULL) {
+    return false;
+  }
+
+  Loop *L = LI->getLoopFor(load->getParent());
+  if (L == NULL) {
+    return false;
+  }
+
+  Value *addr = load->getPointerOperand();
+  if (!SE->isSCEVable(addr->getType())) {
+    return false;
+  }
+
+  const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(SE->getSCEV(addr));
+  if (AR == NULL || AR->getLoop() != L || !AR->isAffine()) {
+    return false;
+  }
+
+  const SCEVConstant *step = dyn_cast<SCEVConstant>(AR->getStepRecurrence(*SE));
+  if (step == NULL || step->getValue()->isZero()) {
+    return false;
+  }
+
+  stride = (long) step->getValue()->getSExtValue();
+  return true;
+}
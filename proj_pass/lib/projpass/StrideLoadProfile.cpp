@@ -2,12 +2,15 @@
   Read in the stride data
 */
 
+#define DEBUG_TYPE "stride-load-profile"
+
 #include "llvm/Module.h"
 #include "llvm/Pass.h"
 #include "llvm/Analysis/Passes.h"
 #include "llvm/Analysis/LoopPass.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Constants.h"
+#include "llvm/Metadata.h"
 #include "llvm/Instructions.h"
 #include "llvm/Function.h"
 #include "llvm/BasicBlock.h"
@@ -23,6 +26,7 @@
 #include <algorithm>
 #include <sys/stat.h>
 #include "StrideLoadProfile.h"
+#include "LoadId.h"
 
 using namespace llvm;
 
@@ -39,29 +43,230 @@ void StrideLoadProfile::getAnalysisUsage(AnalysisUsage &AU) const {
 }
 
 char StrideLoadProfile::ID = 0;
-unsigned int StrideLoadProfile::stride_id = -1;
-unsigned int StrideLoadProfile::load_id = -1;
 static RegisterPass<StrideLoadProfile> Z("stride-load-profile","Load back profile data and generate dependency information");
 
+static const char *STRIDE_PROF_MD = "stride.prof";
+static const unsigned STRIDE_PROF_FIELDS = 5;
+
+static MDNode *pairsToMD(LLVMContext &context, const vector< pair<long, long> > &pairs) {
+  std::vector<Value *> fields;
+  for (unsigned int i = 0; i < pairs.size(); i++) {
+    fields.push_back(ConstantInt::get(Type::getInt64Ty(context), pairs[i].first));
+    fields.push_back(ConstantInt::get(Type::getInt64Ty(context), pairs[i].second));
+  }
+  return MDNode::get(context, fields.empty() ? NULL : &fields[0], fields.size());
+}
+
+static void MDToPairs(const MDNode *node, vector< pair<long, long> > &pairs) {
+  for (unsigned int i = 0; i + 1 < node->getNumOperands(); i += 2) {
+    pairs.push_back(make_pair(
+      (long) cast<ConstantInt>(node->getOperand(i))->getSExtValue(),
+      (long) cast<ConstantInt>(node->getOperand(i + 1))->getSExtValue()));
+  }
+}
+
+static MDNode *correlationsToMD(LLVMContext &context, const vector<deltaCorrelation> &correlations) {
+  std::vector<Value *> fields;
+  for (unsigned int i = 0; i < correlations.size(); i++) {
+    fields.push_back(ConstantInt::get(Type::getInt64Ty(context), correlations[i].delta));
+    fields.push_back(ConstantInt::get(Type::getInt64Ty(context), correlations[i].next_delta));
+    fields.push_back(ConstantInt::get(Type::getInt64Ty(context), correlations[i].count));
+  }
+  return MDNode::get(context, fields.empty() ? NULL : &fields[0], fields.size());
+}
+
+static void MDToCorrelations(const MDNode *node, vector<deltaCorrelation> &correlations) {
+  for (unsigned int i = 0; i + 2 < node->getNumOperands(); i += 3) {
+    deltaCorrelation correlation;
+    correlation.delta = (long) cast<ConstantInt>(node->getOperand(i))->getSExtValue();
+    correlation.next_delta = (long) cast<ConstantInt>(node->getOperand(i + 1))->getSExtValue();
+    correlation.count = (long) cast<ConstantInt>(node->getOperand(i + 2))->getSExtValue();
+    correlations.push_back(correlation);
+  }
+}
+
+void llvm::setStrideProfMetadata(Instruction *inst, const loadInfo &info) {
+  LLVMContext &context = inst->getContext();
+  const Type *Int32Ty = Type::getInt32Ty(context);
+  const Type *Int64Ty = Type::getInt64Ty(context);
+
+  std::vector<Value *> fields;
+  fields.push_back(ConstantInt::get(Int32Ty, info.load_id));
+  fields.push_back(ConstantInt::get(Int32Ty, info.num_strides));
+  fields.push_back(ConstantInt::get(Int32Ty, info.exec_count));
+  fields.push_back(ConstantInt::get(Int32Ty, info.num_zero_diff));
+  fields.push_back(ConstantInt::get(Int32Ty, info.dominant_stride));
+
+  std::vector<Value *> freqs;
+  for (unsigned int i = 0; i < info.top_freqs.size(); i++) {
+    freqs.push_back(ConstantInt::get(Int64Ty, info.top_freqs[i]));
+  }
+  fields.push_back(MDNode::get(context, freqs.empty() ? NULL : &freqs[0], freqs.size()));
+
+  vector< pair<long, long> > histogram(info.stride_histogram.begin(), info.stride_histogram.end());
+  fields.push_back(pairsToMD(context, info.top_strides));
+  fields.push_back(pairsToMD(context, histogram));
+  fields.push_back(pairsToMD(context, info.top_line_strides));
+  fields.push_back(correlationsToMD(context, info.delta_correlations));
+  fields.push_back(pairsToMD(context, info.cache_misses));
+
+  inst->setMetadata(STRIDE_PROF_MD, MDNode::get(context, &fields[0], fields.size()));
+}
+
+bool llvm::getStrideProfMetadata(const Instruction *inst, loadInfo &info) {
+  MDNode *node = inst->getMetadata(STRIDE_PROF_MD);
+  if (node == NULL || node->getNumOperands() != STRIDE_PROF_FIELDS + 6) {
+    return false;
+  }
+
+  info.load_id = cast<ConstantInt>(node->getOperand(0))->getZExtValue();
+  info.num_strides = cast<ConstantInt>(node->getOperand(1))->getSExtValue();
+  info.exec_count = cast<ConstantInt>(node->getOperand(2))->getSExtValue();
+  info.num_zero_diff = cast<ConstantInt>(node->getOperand(3))->getSExtValue();
+  info.dominant_stride = cast<ConstantInt>(node->getOperand(4))->getSExtValue();
+  info.profiled_stride = info.dominant_stride;
+  info.trip_count = 0;
+
+  const MDNode *freqs = cast<MDNode>(node->getOperand(STRIDE_PROF_FIELDS));
+  info.top_freqs.clear();
+  for (unsigned int i = 0; i < freqs->getNumOperands(); i++) {
+    info.top_freqs.push_back(cast<ConstantInt>(freqs->getOperand(i))->getSExtValue());
+  }
+
+  vector< pair<long, long> > histogram;
+  info.top_strides.clear();
+  info.stride_histogram.clear();
+  info.top_line_strides.clear();
+  info.delta_correlations.clear();
+  info.cache_misses.clear();
+  MDToPairs(cast<MDNode>(node->getOperand(STRIDE_PROF_FIELDS + 1)), info.top_strides);
+  MDToPairs(cast<MDNode>(node->getOperand(STRIDE_PROF_FIELDS + 2)), histogram);
+  MDToPairs(cast<MDNode>(node->getOperand(STRIDE_PROF_FIELDS + 3)), info.top_line_strides);
+  MDToCorrelations(cast<MDNode>(node->getOperand(STRIDE_PROF_FIELDS + 4)), info.delta_correlations);
+  MDToPairs(cast<MDNode>(node->getOperand(STRIDE_PROF_FIELDS + 5)), info.cache_misses);
+  for (unsigned int i = 0; i < histogram.size(); i++) {
+    info.stride_histogram[(int) histogram[i].first] = histogram[i].second;
+  }
+  return true;
+}
+
+// Reads "<n> (a b)*" from the extended part of a profile line.
+static bool readPairs(std::istringstream &iss, vector< pair<long, long> > &pairs) {
+  unsigned int n;
+  if (!(iss >> n)) {
+    return false;
+  }
+  for (unsigned int i = 0; i < n; i++) {
+    long first, second;
+    if (!(iss >> first >> second)) {
+      return false;
+    }
+    pairs.push_back(make_pair(first, second));
+  }
+  return true;
+}
+
+// Reads "<tag> <n> (a b)*" from the extended part of a profile line.
+static bool readPairs(std::istringstream &iss, const char *tag, vector< pair<long, long> > &pairs) {
+  std::string token;
+  if (!(iss >> token) || token != tag) {
+    return false;
+  }
+  return readPairs(iss, pairs);
+}
+
+// Reads "<j> (delta next_delta count)*" delta correlations.
+static bool readCorrelations(std::istringstream &iss, vector<deltaCorrelation> &correlations) {
+  unsigned int n;
+  if (!(iss >> n)) {
+    return false;
+  }
+  for (unsigned int i = 0; i < n; i++) {
+    deltaCorrelation correlation;
+    if (!(iss >> correlation.delta >> correlation.next_delta >> correlation.count)) {
+      return false;
+    }
+    correlations.push_back(correlation);
+  }
+  return true;
+}
+
+// Parses the full stride distribution that follows the fixed columns:
+//   T <n> (stride count)* H <m> (bucket count)* L <k> (line_stride count)*
+// optionally followed by the sections of the runtime modes:
+//   C <j> (delta next_delta count)*   STRIDE_CORRELATION
+//   M <n> (accesses misses)*          STRIDE_CACHE
+static void readDistribution(const std::string &line, loadInfo *load_info) {
+  std::istringstream iss(line);
+  std::string token;
+  for (int field = 0; field < 5 + NUM_TOP_FREQ; field++) {
+    if (!(iss >> token)) {
+      return;
+    }
+  }
+
+  vector< pair<long, long> > histogram;
+  if (!readPairs(iss, "T", load_info->top_strides) || 
+      !readPairs(iss, "H", histogram) || 
+      !readPairs(iss, "L", load_info->top_line_strides)) {
+    return;
+  }
+  for (unsigned int i = 0; i < histogram.size(); i++) {
+    load_info->stride_histogram[(int) histogram[i].first] = histogram[i].second;
+  }
+
+  while (iss >> token) {
+    if (token == "C") {
+      if (!readCorrelations(iss, load_info->delta_correlations)) {
+        return;
+      }
+    } else if (token == "M") {
+      if (!readPairs(iss, load_info->cache_misses)) {
+        return;
+      }
+    } else {
+      return;
+    }
+  }
+}
+
+loadInfo *StrideLoadProfile::createLoadInfo() {
+  return new (LoadInfoArena.Allocate()) loadInfo();
+}
+
+void StrideLoadProfile::releaseMemory() {
+  IdToInstMap.clear();
+  InstToIdMap.clear();
+  LoadIdToLoadInst.clear();
+  LoadToLoadInfo.clear();
+  StaleFunctions.clear();
+  LoadInfoArena.DestroyAll();
+}
+
 bool StrideLoadProfile::runOnModule(Module& M) {
-  // build the <IDs, Instrucion> map
+  // build the <IDs, Instrucion> map, loads with a colliding id have none
+  std::map<Instruction*, unsigned int> loadIds;
+  computeModuleLoadIds(M, loadIds);
+
   for (Module::iterator FB = M.begin(), FE = M.end(); FB != FE; FB++) {
     if (!FB->isDeclaration()) {
+
       for (Function::iterator BBB = FB->begin(), BBE = FB->end(); BBB != BBE; ++BBB) {
         for (BasicBlock::iterator IB = BBB->begin(), IE = BBB->end(); IB != IE; IB++) {
-          if (isa<LoadInst>(IB)) {
-            LoadIdToLoadInst[++load_id] = IB; // TODO remove and replace with normal stride_id?
-            llvm::errs() << load_id << " : " << IB << "\n";
+          if (isa<LoadInst>(IB) && loadIds.count(IB)) {
+            unsigned int load_id = loadIds[IB];
+            LoadIdToLoadInst[load_id] = IB;
+            DEBUG(llvm::errs() << load_id << " : " << IB << "\n");
           }
 
           if (isa<LoadInst>(IB) || isa<StoreInst>(IB)){ // count loads, stores, calls
-            IdToInstMap[++stride_id] = IB;
-            InstToIdMap[IB] = stride_id;
+            InstToIdMap[IB] = IdToInstMap.size();
+            IdToInstMap.push_back(IB);
           }
           else if (isa<CallInst>(IB) && ( (dyn_cast<CallInst>(IB)->getCalledFunction() == NULL) || 
                 (dyn_cast<CallInst>(IB)->getCalledFunction()->isDeclaration()))) {
-            IdToInstMap[++stride_id]=IB;
-            InstToIdMap[IB]=stride_id;
+            InstToIdMap[IB] = IdToInstMap.size();
+            IdToInstMap.push_back(IB);
           }
         }
       }
@@ -90,11 +295,11 @@ bool StrideLoadProfile::runOnModule(Module& M) {
       break;
     }
 
-    loadInfo *load_info = new loadInfo;
+    loadInfo *load_info = createLoadInfo();
     unsigned int freq[4];
     sscanf(
         s.c_str(),
-        "%d %d %d %d %d %u %u %u %u",
+        "%u %d %d %d %d %u %u %u %u",
         &(load_info->load_id),
         &(load_info->num_strides),
         &(load_info->exec_count),
@@ -103,16 +308,71 @@ bool StrideLoadProfile::runOnModule(Module& M) {
         &(freq[0]), &(freq[1]), &(freq[2]), &(freq[3])
         );
 
-    llvm::errs() << "Stride Profile ("<<LoadIdToLoadInst[load_info->load_id]<<"): "<<s<<"\n";
+    // loads that no longer exist (or changed location) are dropped
+    if (load_info->load_id >= ~0U - 1 || LoadIdToLoadInst.count(load_info->load_id) == 0) {
+      llvm::errs() << "Stale stride profile entry " << load_info->load_id << "\n";
+      continue;
+    }
+
+    DEBUG(llvm::errs() << "Stride Profile ("<<LoadIdToLoadInst[load_info->load_id]<<"): "<<s<<"\n");
     Instruction *loadinstr = LoadIdToLoadInst[load_info->load_id];
 
     for (int a = 0; a < NUM_TOP_FREQ; a++) {
       load_info->top_freqs.push_back(freq[a]);
     }
     sort(load_info->top_freqs.rbegin(), load_info->top_freqs.rend()); // sort desc order
+    readDistribution(s, load_info);
 
     LoadToLoadInfo[loadinstr] = load_info;
   }
 
-  return true;
+  // function checksums recorded when the profiled binary was instrumented
+  std::map<unsigned int, unsigned int> profiledChecksums;
+  while (getline(ifs, s)) {
+    if (s.find("CHECKSUM_START") != std::string::npos) {
+      continue;
+    }
+    if (s.find("CHECKSUM_END") != std::string::npos) {
+      break;
+    }
+
+    unsigned int function_id, checksum;
+    if (sscanf(s.c_str(), "%u %u", &function_id, &checksum) == 2) {
+      profiledChecksums[function_id] = checksum;
+    }
+  }
+
+  // functions edited since the profile was collected keep no profile data,
+  // the prefetcher falls back to its static heuristics for their loads
+  for (Module::iterator FB = M.begin(), FE = M.end(); FB != FE; FB++) {
+    if (FB->isDeclaration()) {
+      continue;
+    }
+    std::map<unsigned int, unsigned int>::iterator found = profiledChecksums.find(getFunctionId(*FB));
+    if (found != profiledChecksums.end() && found->second != computeFunctionChecksum(*FB)) {
+      llvm::errs() << "Function " << FB->getName() << " changed since profiling, profile ignored\n";
+      StaleFunctions.insert(FB);
+    }
+  }
+
+  if (!StaleFunctions.empty()) {
+    std::vector<Instruction *> staleLoads;
+    for (DenseMap<Instruction *, loadInfo *>::iterator infoIter = LoadToLoadInfo.begin(), 
+        infoEnd = LoadToLoadInfo.end(); infoIter != infoEnd; ++infoIter) {
+      if (StaleFunctions.count(infoIter->first->getParent()->getParent())) {
+        staleLoads.push_back(infoIter->first);
+      }
+    }
+    for (unsigned int i = 0; i < staleLoads.size(); i++) {
+      LoadToLoadInfo.erase(staleLoads[i]);
+    }
+  }
+
+  // attach the profile to the loads so later passes need not run this one
+  for (DenseMap<Instruction *, loadInfo *>::iterator infoIter = LoadToLoadInfo.begin(), 
+      infoEnd = LoadToLoadInfo.end(); infoIter != infoEnd; ++infoIter) {
+    setStrideProfMetadata(infoIter->first, *(infoIter->second));
+  }
+
+  return !LoadToLoadInfo.empty();
 }
@@ -7,6 +7,7 @@
 #include "llvm/Constants.h"
 #include "llvm/DerivedTypes.h"
 #include "llvm/Module.h"
+#include "llvm/Metadata.h"
 #include "llvm/Pass.h"
 #include "llvm/Instructions.h"
 #include "llvm/IntrinsicInst.h"
@@ -17,17 +18,22 @@
 
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/LoopPass.h"	
+#include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/Analysis/Passes.h"
 
 #include "llvm/Support/Debug.h"
 #include <iostream>
+#include <fstream>
+#include <vector>
 #include <set>
 #include <map>
 #include <algorithm>
 
 #include "loadstride.h"
 #include "profilefeedback.h"
+#include "StaticStride.h"
+#include "LoadId.h"
 
 using namespace llvm;
 using namespace std;
@@ -35,41 +41,45 @@ using namespace std;
 namespace {
   class StrideProfiler : public FunctionPass {
     bool runOnFunction(Function& F);
-    void doStrides();
+    void doStrides(const vector<Instruction *> &loadsToStride,
+        const map<Instruction *, double> &loadToExecCount);
     bool isLoadDynamic(Instruction *inst);
     ProfileInfo *PI;
     LoopInfo *LI;
+    ScalarEvolution *SE;
     Constant* StrideProfileFn;
     Constant* StrideProfileClearAddresses;
     void createLampDeclarations(Module* M);
+    void recordChecksums(Module &M);
     TargetData* TD;
-    bool ranOnce;
+
+    // stable ids of every load in the module, computed in doInitialization
+    // before anything is instrumented and only read afterwards
+    map<Instruction *, unsigned int> loadToLoadId;
     public:
     virtual void getAnalysisUsage(AnalysisUsage &AU) const {
       AU.addRequired<ProfileInfo>();
       AU.addRequired<TargetData>();
       AU.addRequired<LoopInfo>();
+      AU.addRequired<ScalarEvolution>();
     }
 
-    bool doInitialization(Module &M) { return false; }
-    static unsigned int instruction_id;
-
-    static unsigned int load_id; // counts the loads that we are analyzing bro
+    bool doInitialization(Module &M);
 
     static char ID;
     StrideProfiler() : FunctionPass(ID) {
-      //instruction_id = 0;
-      ranOnce = false;
       TD = NULL;
       LI = NULL;
+      SE = NULL;
       PI = NULL;
     } 
   };
 }
 
 char StrideProfiler::ID = 0;
-unsigned int StrideProfiler::instruction_id = -1;
-unsigned int StrideProfiler::load_id = -1;
+
+// name of the module level table of function checksums read by StrideInit
+static const char *STRIDE_CHECKSUMS_MD = "stride.checksums";
 
 static RegisterPass<StrideProfiler>
 X("insert-stride-profiling",
@@ -96,32 +106,52 @@ void StrideProfiler::createLampDeclarations(Module* M)
   );
 }
 
-vector<Instruction *> loadsToStride;
-map<Instruction *, double> loadToExecCount;
+// Records (function id, checksum) of every function in the module, taken
+// before instrumentation, as the named metadata !stride.checksums.
+void StrideProfiler::recordChecksums(Module &M) {
+  NamedMDNode *Checksums = M.getOrInsertNamedMetadata(STRIDE_CHECKSUMS_MD);
+  for (Module::iterator IF = M.begin(), E = M.end(); IF != E; ++IF) {
+    if (IF->isDeclaration()) {
+      continue;
+    }
+    Value *Fields[2];
+    Fields[0] = ConstantInt::get(llvm::Type::getInt32Ty(M.getContext()), getFunctionId(*IF));
+    Fields[1] = ConstantInt::get(llvm::Type::getInt32Ty(M.getContext()), computeFunctionChecksum(*IF));
+    Checksums->addOperand(MDNode::get(M.getContext(), Fields, 2));
+  }
+}
+
+// All module level work is done here, so runOnFunction only touches the
+// function it is given.
+bool StrideProfiler::doInitialization(Module &M) {
+  createLampDeclarations(&M);
+
+  computeModuleLoadIds(M, loadToLoadId);
+
+  recordChecksums(M);
+  return true;
+}
 
 bool StrideProfiler::isLoadDynamic(Instruction *inst)
 {
-    Loop *CurLoop = NULL;
-    LoopInfo &LI = getAnalysis<LoopInfo>();
-    
-    for(LoopInfo::iterator IT = LI.begin(), ITe = LI.end(); IT != ITe; ++IT)
-    {
-        if ((*IT)->contains(inst)) {
-            CurLoop = *IT;
-            break;
-        }
-    }
-    
+    // outermost loop containing the load
+    Loop *CurLoop = LI->getLoopFor(inst->getParent());
     if (CurLoop == NULL) {
         return false;
     }
+    while (CurLoop->getParentLoop() != NULL) {
+        CurLoop = CurLoop->getParentLoop();
+    }
 
     //If operands are loop invariant, you are always loading the same address
     //strides of 0 get no advantage of prefetch so don't waste time profiling
     return !CurLoop->hasLoopInvariantOperands(inst);
 }
 
-void StrideProfiler::doStrides() {
+// Instruments the hot dynamic loads of one function. The worklist only
+// holds that function's loads, so every load is visited exactly once.
+void StrideProfiler::doStrides(const vector<Instruction *> &loadsToStride,
+    const map<Instruction *, double> &loadToExecCount) {
   Instruction *I;
   Value *compare;
   BinaryOperator *newNum;
@@ -129,17 +159,29 @@ void StrideProfiler::doStrides() {
   for (unsigned int i = 0; i < loadsToStride.size(); i++) {
     I = loadsToStride[i];
 
-    load_id++;
+    // loads whose id collides with another load have no id
+    map<Instruction *, unsigned int>::const_iterator id = loadToLoadId.find(I);
+    if (id == loadToLoadId.end()) {
+      continue;
+    }
+    unsigned int load_id = id->second;
+    double exec_count = loadToExecCount.find(I)->second;
+
+    // affine addresses have a known stride, the prefetcher recomputes it
+    long static_stride;
+    if (getStaticStride(SE, LI, I, static_stride)) {
+      errs() << "Static stride <" << static_stride << "> for load id<" << load_id << "> not profiled\n";
+      continue;
+    }
     
-    if(!isLoadDynamic(I) || loadToExecCount[I] < FT) {
+    if(!isLoadDynamic(I) || exec_count < FT) {
         continue;
     }
     
     num_profiled++;
-    errs() << "Found dynamic load id<" << load_id << "> ("<<(loadToExecCount[I])<<") inst " << *I <<"\n";
+    errs() << "Found dynamic load id<" << load_id << "> ("<<exec_count<<") inst " << *I <<"\n";
 
     int chunkSize = 30;
-    double exec_count = loadToExecCount[I];
     // N2 = number to profile ; N1 = number to skip
     int tmpN2 = (int) (1.0/20.0 * exec_count);
     tmpN2 = tmpN2 < 1 ? (int)exec_count : tmpN2;
@@ -287,31 +329,21 @@ void StrideProfiler::doStrides() {
 }
 
 bool StrideProfiler::runOnFunction(Function &F) {
-  if (ranOnce == false) {
-    Module* M = F.getParent();
-    createLampDeclarations(M);
-    ranOnce = true;
-  }
+  TD = &getAnalysis<TargetData>();
+  LI = &getAnalysis<LoopInfo>();
+  PI = &getAnalysis<ProfileInfo>();
+  SE = &getAnalysis<ScalarEvolution>();
 
-  if (TD == NULL) {
-    TD = &getAnalysis<TargetData>();
-  }
-  if (LI == NULL) {
-    LI = &getAnalysis<LoopInfo>();
-  }
-  if (PI == NULL) {
-    PI = &getAnalysis<ProfileInfo>();
-  }
-  
-  //DOUT << "Instrumenting Function " << F.getName() << " beginning ID: " << instruction_id << std::endl;
+  unsigned int instruction_id = 0;
+  vector<Instruction *> loadsToStride;
+  map<Instruction *, double> loadToExecCount;
 
   for (Function::iterator IF = F.begin(), IE = F.end(); IF != IE; ++IF) {
     BasicBlock& BB = *IF;
     
     for (BasicBlock::iterator I = BB.begin(), E = BB.end(); I != E; ++I) {
       if (isa<LoadInst>(I)) {
-        instruction_id++;
-        errs() << instruction_id <<" is: "<< *I << "\n";
+        errs() << F.getName() << ":" << instruction_id++ <<" is: "<< *I << "\n";
         
         // TODO only call this function if this load has some freq count above some threshold (use edge profiling to figure this out)
         loadToExecCount[I] = PI->getExecutionCount(I->getParent());
@@ -320,7 +352,7 @@ bool StrideProfiler::runOnFunction(Function &F) {
     }
   }
 
-  doStrides();
+  doStrides(loadsToStride, loadToExecCount);
 
   return true;
 }
@@ -362,9 +394,96 @@ bool StrideInit::runOnModule(Module& M) {
       }
 
       CallInst::Create(InitFn, "", InsertPos);														
+
+      // record the checksum of every instrumented function in the profile
+      NamedMDNode *Checksums = M.getNamedMetadata(STRIDE_CHECKSUMS_MD);
+      if (Checksums == NULL) {
+        return true;
+      }
+
+      Constant *ChecksumFn = M.getOrInsertFunction(
+        "Stride_RecordChecksum",
+        llvm::Type::getVoidTy(M.getContext()),
+        llvm::Type::getInt32Ty(M.getContext()),
+        llvm::Type::getInt32Ty(M.getContext()),
+        (Type *) 0
+      );
+      for (unsigned int i = 0, e = Checksums->getNumOperands(); i != e; ++i) {
+        MDNode *Entry = Checksums->getOperand(i);
+        std::vector<Value*> ChecksumArgs(2);
+        ChecksumArgs[0] = Entry->getOperand(0);
+        ChecksumArgs[1] = Entry->getOperand(1);
+        CallInst::Create(ChecksumFn, ChecksumArgs.begin(), ChecksumArgs.end(), "", InsertPos);
+      }
       return true;
     }
   }
   return false;
 }
 
+
+namespace {
+  // Writes the load site table used by tools/stride-sampler to attribute
+  // sampled load addresses to load ids. Nothing is instrumented, run it on
+  // the bitcode the uninstrumented -g binary is built from.
+  class StrideSites : public ModulePass {
+    bool runOnModule(Module& M);
+
+    public:
+    virtual void getAnalysisUsage(AnalysisUsage &AU) const {
+      AU.setPreservesAll();
+    }
+
+    static char ID;
+    StrideSites() : ModulePass(ID) { }
+  };
+}
+
+char StrideSites::ID = 0;
+
+static RegisterPass<StrideSites>
+W("emit-stride-sites", "Write the load sites of the module to result.stride.sites");
+
+ModulePass *llvm::createStrideSitesPass() { return new StrideSites(); }
+
+// result.stride.sites:
+//   SITES_START
+//   <load_id> <function> <line> <col>     one per load with a debug location
+//   SITES_END
+//   CHECKSUM_START
+//   <function_id> <checksum>
+//   CHECKSUM_END
+bool StrideSites::runOnModule(Module& M) {
+  std::ofstream sites("result.stride.sites");
+
+  map<Instruction *, unsigned int> loadIds;
+  computeModuleLoadIds(M, loadIds);
+
+  sites << "SITES_START" << endl;
+  for (Module::iterator IF = M.begin(), E = M.end(); IF != E; ++IF) {
+    if (IF->isDeclaration()) {
+      continue;
+    }
+
+    for (Function::iterator BB = IF->begin(), BE = IF->end(); BB != BE; ++BB) {
+      for (BasicBlock::iterator I = BB->begin(), IE = BB->end(); I != IE; ++I) {
+        if (!isa<LoadInst>(I) || I->getDebugLoc().isUnknown() || loadIds.count(I) == 0) {
+          continue;
+        }
+        sites << loadIds[I] << " " << IF->getName().str() << " " 
+              << I->getDebugLoc().getLine() << " " << I->getDebugLoc().getCol() << endl;
+      }
+    }
+  }
+  sites << "SITES_END" << endl;
+
+  sites << "CHECKSUM_START" << endl;
+  for (Module::iterator IF = M.begin(), E = M.end(); IF != E; ++IF) {
+    if (!IF->isDeclaration()) {
+      sites << getFunctionId(*IF) << " " << computeFunctionChecksum(*IF) << endl;
+    }
+  }
+  sites << "CHECKSUM_END" << endl;
+
+  return false;
+}
@@ -25,6 +25,9 @@
 #include "llvm/Analysis/LoopPass.h"
 #include "llvm/Analysis/Dominators.h"
 #include "llvm/Analysis/ProfileInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpander.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Transforms/Utils/Local.h"
 #include "llvm/Transforms/Utils/SSAUpdater.h"
 #include "llvm/Support/CFG.h"
@@ -34,6 +37,7 @@
 #include "llvm/ADT/Statistic.h"
 #include "profilefeedback.h"
 #include "StrideLoadProfile.h"
+#include "StaticStride.h"
 #include <vector>
 #include <algorithm>
 #include <cmath>
@@ -50,6 +54,30 @@
 using namespace std;
 using namespace llvm;
 
+// marks the header terminator of the short trip count clone of a versioned loop
+static const char *STRIDE_NOPF_MD = "stride.nopf";
+
+// Static mode: no edge or stride profile is needed. Run with 
+// -profile-estimator so ProfileInfo holds loop-frequency estimates, strides
+// come from ScalarEvolution and trip counts from the backedge-taken count.
+static cl::opt<bool>
+StaticPrefetch("stride-static", cl::init(false),
+    cl::desc("Prefetch using ScalarEvolution strides only, without profiles"));
+
+// Correlation mode: loads without a usable stride get a prefetch driven by
+// the delta correlations recorded with STRIDE_CORRELATION=1.
+static cl::opt<bool>
+MarkovPrefetch("stride-markov", cl::init(false),
+    cl::desc("Prefetch irregular loads from their profiled delta correlations"));
+
+// Miss ratio gate: drop loads whose simulated L1 miss ratio is below MISS_T.
+// The simulator only sees the instrumented loads inside the profiling
+// windows, no stores and no affine loads, so its ratios run low; an M
+// section in the profile alone does not turn the gate on.
+static cl::opt<bool>
+CacheGate("stride-cache-gate", cl::init(false),
+    cl::desc("Skip loads the simulated L1 (STRIDE_CACHE) rarely misses on"));
+
 namespace llvm {
   void initializeStridePrefetchPass(llvm::PassRegistry&);
 }
@@ -72,35 +100,56 @@ namespace {
       virtual void getAnalysisUsage(AnalysisUsage &AU) const {
         AU.addRequired<DominatorTree>();
         AU.addRequired<LoopInfo>();
+        AU.addRequiredID(LoopSimplifyID);
+        AU.addRequiredID(LCSSAID);
+        AU.addRequired<ScalarEvolution>();
         AU.addRequired<ProfileInfo>();
         AU.addRequired<AliasAnalysis>();
-        AU.addRequired<StrideLoadProfile>();
+      }
+
+      virtual void releaseMemory() {
+        LoadInfos.clear();
+        LoadInfoArena.DestroyAll();
       }
 
     private:
+      // Everything below lives for one runOnLoop call: it is reset there or
+      // in releaseMemory. Facts that must outlive a loop, such as which
+      // loops are unversioned clones, are kept in the IR.
       AliasAnalysis *AA;
       LoopInfo *LI;
       DominatorTree *DT;
       ProfileInfo *PI;
-      StrideLoadProfile *LP;
+      ScalarEvolution *SE;
+
+      // profiles decoded from !stride.prof or built from ScalarEvolution
+      DenseMap<Instruction*, loadInfo*> LoadInfos;
+      SpecificBumpPtrAllocator<loadInfo> LoadInfoArena;
+      LPPassManager *CurrentLPM;
 
-      typedef map<const Loop * const, unsigned int> InstsPerLoopMap;
-      // tracks number of instructions per loop body
-      InstsPerLoopMap instsPerLoopMap;
+      // average number of instructions per iteration of CurrentLoop, -1
+      // until getLoopInstructionCount computes it
+      int loopInstCount;
 
       bool Changed;
       BasicBlock *Preheader;
       Loop *CurrentLoop;
 
+      // backedge-taken count of CurrentLoop when the loop can be versioned on
+      // its runtime trip count, NULL otherwise
+      const SCEV *BackedgeTakenCount;
+
       set <Instruction*> SSST_loads;
       set <Instruction*> PMST_loads;
       set <Instruction*> WSST_loads;
+      set <Instruction*> MARKOV_loads;
 
       bool insideSubLoop(BasicBlock *BB) {
         return (LI->getLoopFor(BB) != CurrentLoop);
       }
 
       loadInfo* getInfo(Instruction* inst);
+      loadInfo* getStaticInfo(Instruction* inst);
       void profile(Instruction* inst);
       BinaryOperator *scratchAndSub(Instruction *inst);
       void insertPrefetchInsts(const set<Instruction*>& loads);
@@ -108,11 +157,17 @@ namespace {
       void insertSSST(Instruction *inst, const double& K);
       void insertPMST(Instruction *inst, const double& K);
       void insertWSST(Instruction *inst, const double& K);
+      void insertMarkov(Instruction *inst);
+      bool hasDeltaCorrelations(loadInfo *profData);
       void insertLoad(Instruction *inst);
       void actuallyInsertPrefetch(loadInfo* load_info, Instruction *before, 
           Instruction *address, int locality = 3);
       void loopOver(DomTreeNode *N);
       unsigned getLoopInstructionCount(const Loop * const loop);
+      int getTripCount(Loop *L);
+      const SCEV *getVersioningTripCount(Loop *L);
+      Loop *cloneLoopStructure(Loop *L, Loop *ParentLoop, ValueToValueMapTy &VMap);
+      void versionLoop(Loop *L);
   };
 }
 
@@ -127,6 +182,8 @@ char StridePrefetch::ID = 0;
   INITIALIZE_PASS_DEPENDENCY(DominatorTree)
   INITIALIZE_PASS_DEPENDENCY(LoopInfo)
   INITIALIZE_PASS_DEPENDENCY(LoopSimplify)
+  INITIALIZE_PASS_DEPENDENCY(LCSSA)
+  INITIALIZE_PASS_DEPENDENCY(ScalarEvolution)
     INITIALIZE_AG_DEPENDENCY(AliasAnalysis)
   INITIALIZE_PASS_END(StridePrefetch, "strideprefetch", "Stride Prefetching", false, false)
   static RegisterPass<StridePrefetch> X("projpass", "LICM Pass", true, true);
@@ -134,35 +191,201 @@ char StridePrefetch::ID = 0;
   bool StridePrefetch::runOnLoop(Loop *L, LPPassManager &LPM) {
     Changed = false;
 
+    // the short trip count version of a loop is never prefetched
+    if (L->getHeader()->getTerminator()->getMetadata(STRIDE_NOPF_MD)) {
+      return false;
+    }
+
     // clear data structures
     SSST_loads.clear();
     PMST_loads.clear();
     WSST_loads.clear();
+    MARKOV_loads.clear();
 
     LI = &getAnalysis<LoopInfo>();
     PI = &getAnalysis<ProfileInfo>();
-    LP = &getAnalysis<StrideLoadProfile>();
     DT = &getAnalysis<DominatorTree>();
+    SE = &getAnalysis<ScalarEvolution>();
+    CurrentLPM = &LPM;
 
     Preheader = L->getLoopPreheader();
     Preheader->setName(Preheader->getName() + ".preheader");
 
     CurrentLoop = L;
+    loopInstCount = -1;
+    BackedgeTakenCount = getVersioningTripCount(L);
 
     loopOver(DT->getNode(L->getHeader()));
 
+    if (BackedgeTakenCount != NULL && 
+        (!SSST_loads.empty() || !PMST_loads.empty() || !WSST_loads.empty() ||
+         !MARKOV_loads.empty())) {
+      versionLoop(L);
+    }
+
     insertPrefetchInsts(SSST_loads); 
     insertPrefetchInsts(PMST_loads); 
     insertPrefetchInsts(WSST_loads); 
+    insertPrefetchInsts(MARKOV_loads); 
 
     // clear varaibles for the next runOnLoop iteration
     CurrentLoop = 0;
     Preheader = 0;
+    BackedgeTakenCount = 0;
 
     return Changed;
   }
 
-// Inserts prefetch instructions for the loads that are SSST, PMST, and WSST.
+// Returns the backedge-taken count of L if the loop can be versioned on its
+// runtime trip count. Only innermost loops are versioned so that prefetches
+// already inserted into subloops are never copied into the short version.
+const SCEV *StridePrefetch::getVersioningTripCount(Loop *L) {
+  if (!L->empty() || L->getLoopPreheader() == NULL) {
+    return NULL;
+  }
+
+  if (!isa<BranchInst>(L->getLoopPreheader()->getTerminator())) {
+    return NULL;
+  }
+
+  const SCEV *BTC = SE->getBackedgeTakenCount(L);
+  if (isa<SCEVCouldNotCompute>(BTC) || !BTC->getType()->isIntegerTy()) {
+    return NULL;
+  }
+
+  // a constant trip count is decided at compile time by getTripCount
+  if (isa<SCEVConstant>(BTC)) {
+    return NULL;
+  }
+
+  errs() << "trip count computable, versioning on " << *BTC << "\n";
+  return BTC;
+}
+
+// Recreates the Loop objects of L for the cloned blocks in VMap.
+Loop *StridePrefetch::cloneLoopStructure(Loop *L, Loop *ParentLoop, 
+    ValueToValueMapTy &VMap) {
+  Loop *NewLoop = new Loop();
+  CurrentLPM->insertLoop(NewLoop, ParentLoop);
+
+  for (Loop::block_iterator I = L->block_begin(), E = L->block_end(); I != E; ++I) {
+    if (LI->getLoopFor(*I) == L) {
+      NewLoop->addBasicBlockToLoop(cast<BasicBlock>(VMap[*I]), LI->getBase());
+    }
+  }
+
+  for (Loop::iterator I = L->begin(), E = L->end(); I != E; ++I) {
+    cloneLoopStructure(*I, NewLoop, VMap);
+  }
+  return NewLoop;
+}
+
+// Versions the current loop on its runtime trip count:
+//   preheader: if (trip_count > TT) goto prefetching loop else goto clone
+// The original loop receives the prefetches, the clone is left untouched so
+// short invocations pay no prefetch overhead.
+void StridePrefetch::versionLoop(Loop *L) {
+  Function *F = Preheader->getParent();
+  BasicBlock *CheckBB = Preheader;
+
+  // CheckBB keeps the trip count test, the new preheader belongs to L
+  BasicBlock *NewPreheader = SplitEdge(CheckBB, L->getHeader(), this);
+
+  vector<BasicBlock*> LoopBlocks;
+  LoopBlocks.push_back(NewPreheader);
+  LoopBlocks.insert(LoopBlocks.end(), L->block_begin(), L->block_end());
+
+  // give every exit edge its own block so both versions can feed the
+  // LCSSA phis of the exit blocks
+  SmallVector<BasicBlock*, 8> ExitBlocks;
+  L->getUniqueExitBlocks(ExitBlocks);
+  for (unsigned i = 0, e = ExitBlocks.size(); i != e; ++i) {
+    BasicBlock *ExitBlock = ExitBlocks[i];
+    SmallVector<BasicBlock*, 4> Preds(pred_begin(ExitBlock), pred_end(ExitBlock));
+    SplitBlockPredecessors(ExitBlock, Preds.data(), Preds.size(), ".pfexit", this);
+  }
+
+  ExitBlocks.clear();
+  L->getUniqueExitBlocks(ExitBlocks);
+  LoopBlocks.insert(LoopBlocks.end(), ExitBlocks.begin(), ExitBlocks.end());
+
+  // clone the preheader, the loop body and the exit blocks
+  ValueToValueMapTy VMap;
+  vector<BasicBlock*> NewBlocks;
+  for (unsigned i = 0, e = LoopBlocks.size(); i != e; ++i) {
+    BasicBlock *NewBB = CloneBasicBlock(LoopBlocks[i], VMap, ".nopf", F);
+    NewBlocks.push_back(NewBB);
+    VMap[LoopBlocks[i]] = NewBB;
+    CurrentLPM->cloneBasicBlockSimpleAnalysis(LoopBlocks[i], NewBB, L);
+  }
+
+  F->getBasicBlockList().splice(NewPreheader, F->getBasicBlockList(),
+                                NewBlocks[0], F->end());
+
+  Loop *ParentLoop = L->getParentLoop();
+  Loop *NewLoop = cloneLoopStructure(L, ParentLoop, VMap);
+  // tag the clone in the IR, Loop objects do not outlive the function
+  NewLoop->getHeader()->getTerminator()->setMetadata(STRIDE_NOPF_MD,
+      MDNode::get(F->getContext(), NULL, 0));
+  if (ParentLoop) {
+    ParentLoop->addBasicBlockToLoop(NewBlocks[0], LI->getBase());
+  }
+
+  for (unsigned i = 0, e = ExitBlocks.size(); i != e; ++i) {
+    BasicBlock *NewExit = cast<BasicBlock>(VMap[ExitBlocks[i]]);
+    if (Loop *ExitLoop = LI->getLoopFor(ExitBlocks[i])) {
+      ExitLoop->addBasicBlockToLoop(NewExit, LI->getBase());
+    }
+
+    assert(NewExit->getTerminator()->getNumSuccessors() == 1 &&
+        "Exit block should have been split to have one successor!");
+    BasicBlock *ExitSucc = NewExit->getTerminator()->getSuccessor(0);
+
+    for (BasicBlock::iterator I = ExitSucc->begin(); isa<PHINode>(I); ++I) {
+      PHINode *PN = cast<PHINode>(I);
+      Value *V = PN->getIncomingValueForBlock(ExitBlocks[i]);
+      ValueToValueMapTy::iterator It = VMap.find(V);
+      if (It != VMap.end()) {
+        V = It->second;
+      }
+      PN->addIncoming(V, NewExit);
+    }
+  }
+
+  // make the clone refer to its own values
+  for (unsigned i = 0, e = NewBlocks.size(); i != e; ++i) {
+    for (BasicBlock::iterator I = NewBlocks[i]->begin(), E = NewBlocks[i]->end(); 
+        I != E; ++I) {
+      RemapInstruction(I, VMap, RF_NoModuleLevelChanges);
+    }
+  }
+
+  // trip_count = backedge_taken + 1 > TT  <=>  backedge_taken >= TT
+  BranchInst *OldBR = cast<BranchInst>(CheckBB->getTerminator());
+  SCEVExpander Expander(*SE);
+  Value *BTC = Expander.expandCodeFor(BackedgeTakenCount, 
+      BackedgeTakenCount->getType(), OldBR);
+  ICmpInst *LongTrip = new ICmpInst(
+    OldBR,
+    ICmpInst::ICMP_UGE,
+    BTC,
+    ConstantInt::get(BTC->getType(), TT),
+    "pftripcheck"
+  );
+  BranchInst::Create(NewPreheader, NewBlocks[0], LongTrip, OldBR);
+  CurrentLPM->deleteSimpleAnalysisValue(OldBR, L);
+  OldBR->eraseFromParent();
+
+  // the clones are not in the tree and every exit successor is now
+  // dominated by CheckBB, later loops of this function need both
+  DT->runOnFunction(*F);
+
+  errs() << "versioned loop " << L->getHeader()->getName() << " on trip count > " << TT << "\n";
+  Changed = true;
+}
+
+// Inserts prefetch instructions for the loads that are SSST, PMST, WSST and
+// MARKOV.
 void StridePrefetch::insertPrefetchInsts(const set<Instruction*>& loads) {
   set<Instruction*>::const_iterator loadIter;
   for (loadIter = loads.begin(); loadIter != loads.end(); ++loadIter) {
@@ -182,7 +405,15 @@ void StridePrefetch::loopOver(DomTreeNode *N) {
     for (BasicBlock::iterator II = BB->begin(), E = BB->end(); II != E; II++) {
 
       Instruction *I = II;
-      if (dyn_cast<LoadInst>(I) && getInfo(I) != NULL) {
+      if (!dyn_cast<LoadInst>(I)) {
+        continue;
+      }
+      // in static mode profile records are ignored, only affine loads count
+      loadInfo *info = StaticPrefetch ? NULL : getInfo(I);
+      if (info == NULL) {
+        info = getStaticInfo(I);
+      }
+      if (info != NULL) {
         // TODO - decide if this is an instruction to actually profile?
         if(PI->getExecutionCount(I->getParent()) > 0) {
           profile(I);
@@ -198,13 +429,53 @@ void StridePrefetch::loopOver(DomTreeNode *N) {
 }
 
 loadInfo* StridePrefetch::getInfo(Instruction* inst) {
-  map<Instruction*, loadInfo*>::iterator findInfo;
-  findInfo = LP->LoadToLoadInfo.find(inst);
-  if (findInfo == LP->LoadToLoadInfo.end()) {
+  DenseMap<Instruction*, loadInfo*>::iterator findInfo;
+  findInfo = LoadInfos.find(inst);
+  if (findInfo != LoadInfos.end()) {
+    return findInfo->second;
+  }
+
+  // decoded once per load, the metadata is left by -stride-load-profile
+  loadInfo profData;
+  if (!getStrideProfMetadata(inst, profData)) {
     //errs() << "couldnt find " << *inst << " in getInfo!\n";
     return NULL;
   }
-  return findInfo->second;
+  loadInfo *load_info = new (LoadInfoArena.Allocate()) loadInfo(profData);
+  LoadInfos[inst] = load_info;
+  return load_info;
+}
+
+// Loads with an affine address are not profiled, build their profile from
+// the ScalarEvolution stride instead: a single stride that always repeats.
+loadInfo* StridePrefetch::getStaticInfo(Instruction* inst) {
+  long stride;
+  if (!getStaticStride(SE, LI, inst, stride)) {
+    return NULL;
+  }
+
+  double exec_count = PI->getExecutionCount(inst->getParent());
+  if (exec_count <= 0) {
+    return NULL;
+  }
+
+  loadInfo *load_info = new (LoadInfoArena.Allocate()) loadInfo();
+  load_info->load_id = -1;
+  load_info->num_strides = 1;
+  load_info->exec_count = (int) exec_count;
+  load_info->num_zero_diff = (int) exec_count;
+  load_info->dominant_stride = (int) stride;
+  load_info->profiled_stride = (int) stride;
+  load_info->trip_count = 0;
+  load_info->top_freqs.push_back((long) exec_count);
+  load_info->top_strides.push_back(make_pair(stride, (long) exec_count));
+  for (int a = 1; a < NUM_TOP_FREQ; a++) {
+    load_info->top_freqs.push_back(0);
+  }
+
+  errs() << "static stride <" << stride << "> for " << *inst << "\n";
+  LoadInfos[inst] = load_info;
+  return load_info;
 }
 
 void StridePrefetch::actuallyInsertPrefetch(loadInfo *load_info, 
@@ -244,18 +515,27 @@ void StridePrefetch::profile(Instruction *inst) {
   loadInfo *profData = getInfo(inst);
 
   // set the trip_count variable
-  profData->trip_count = static_cast<int>(
-    PI->getExecutionCount(CurrentLoop->getHeader()) / PI->getExecutionCount(Preheader)
-  );
+  profData->trip_count = getTripCount(CurrentLoop);
 
-  if (PI->getExecutionCount(inst->getParent()) <= FT) {
+  // estimated block frequencies say nothing about hotness in static mode
+  if (!StaticPrefetch && PI->getExecutionCount(inst->getParent()) <= FT) {
     return;
   }
   // assume that loads passed in are in loops
-  if (profData->trip_count <= TT) {
+  // a versioned loop checks the trip count at runtime instead
+  if (BackedgeTakenCount == NULL && profData->trip_count <= TT) {
     return;
   }
 
+  // loads that hit in the simulated L1 gain nothing from a prefetch
+  if (CacheGate && !profData->cache_misses.empty()) {
+    const pair<long, long> &l1 = profData->cache_misses[0];
+    if (l1.first > 0 && (double)l1.second / l1.first <= MISS_T) {
+      errs() << "L1 miss ratio " << l1.second << " / " << l1.first << " too low\n";
+      return;
+    }
+  }
+
   freq1 = profData->top_freqs[0];
   exec_count = profData->exec_count;
   if(exec_count <= 0){
@@ -286,11 +566,26 @@ void StridePrefetch::profile(Instruction *inst) {
     WSST_loads.insert(inst);
     errs() << "adding to WSST\n";
   }
+  else if (MarkovPrefetch && hasDeltaCorrelations(profData)) {
+    MARKOV_loads.insert(inst);
+    errs() << "adding to MARKOV\n";
+  }
   else {
     errs() << "adding to none\n";
   }
 }
 
+// True if one of the profiled delta correlations explains enough strides
+// to be worth a table lookup.
+bool StridePrefetch::hasDeltaCorrelations(loadInfo *profData) {
+  for (unsigned int i = 0; i < profData->delta_correlations.size(); i++) {
+    if ((double)profData->delta_correlations[i].count / profData->exec_count > MARKOV_T) {
+      return true;
+    }
+  }
+  return false;
+}
+
 // insert an alloca to hold address
 // insert an alloca to hold stride
 // insert a subtract stride = addr(load) - scratch
@@ -385,11 +680,58 @@ void StridePrefetch::insertSSST(Instruction *inst, const double& K) {
   insertPrefetch(inst, K, NULL, inst);
 }
 
-// scratch sub
-// prefetch(addr(load)+K*stride) before the load, K is rounded to a power of 2, 
+// scratch sub with a two-delta stride phase predictor
+// confirmed = (stride == last_stride) && stride != 0 && stride in profiled strides
+// last_stride = stride
+// confirmed?prefetch(addr(load)+K*stride), K is rounded to a power of 2
 void StridePrefetch::insertPMST(Instruction *inst, const double& K) {
+  LLVMContext &context = Preheader->getParent()->getContext();
+  BasicBlock &entry = inst->getParent()->getParent()->getEntryBlock();
+
   BinaryOperator *subPtr = scratchAndSub(inst);
-  insertPrefetch(inst, K, subPtr, inst);
+
+  // last stride of this load, kept in a register once mem2reg runs; reset
+  // in the preheader so no entry of the loop starts out confirmed by the
+  // stride the previous one ended on
+  AllocaInst *lastStridePtr = new AllocaInst(
+      llvm::Type::getInt32Ty(context),
+      "laststride" + inst->getName(),
+      entry.begin()
+      );
+  new StoreInst(ConstantInt::get(llvm::Type::getInt32Ty(context), 0), 
+      lastStridePtr, Preheader->getTerminator());
+  LoadInst *lastStride = new LoadInst(lastStridePtr, "loadlaststride", inst);
+  new StoreInst(subPtr, lastStridePtr, inst);
+
+  // a phase is confirmed once the same non-zero stride repeats
+  Value *confirmed = new ICmpInst(inst, ICmpInst::ICMP_EQ, subPtr, lastStride, "phaseconfirmed");
+  Value *nonZero = new ICmpInst(inst, ICmpInst::ICMP_NE, subPtr, 
+      ConstantInt::get(llvm::Type::getInt32Ty(context), 0), "phasenonzero");
+  confirmed = BinaryOperator::Create(Instruction::And, confirmed, nonZero, "phasecheck", inst);
+
+  // and only for the strides the profile saw, transitions between phases
+  // produce strides outside this set
+  loadInfo *profData = getInfo(inst);
+  Value *profiled = NULL;
+  for (unsigned int i = 0; i < profData->top_strides.size() && i < PMST_PHASE_STRIDES; i++) {
+    Value *isStride = new ICmpInst(inst, ICmpInst::ICMP_EQ, subPtr,
+        ConstantInt::get(llvm::Type::getInt32Ty(context), profData->top_strides[i].first), 
+        "phasestride");
+    profiled = profiled == NULL ? isStride : 
+      BinaryOperator::Create(Instruction::Or, profiled, isStride, "phasestrides", inst);
+  }
+  if (profiled != NULL) {
+    confirmed = BinaryOperator::Create(Instruction::And, confirmed, profiled, "phasecheck", inst);
+  }
+
+  BasicBlock* homeBB = inst->getParent();
+  BasicBlock* prefetchBB = SplitBlock(homeBB, inst, this);
+  BasicBlock* restBB = SplitBlock(prefetchBB, inst, this);
+
+  BranchInst::Create(prefetchBB, restBB, confirmed, homeBB->getTerminator());
+  homeBB->getTerminator()->eraseFromParent(); 
+
+  insertPrefetch(inst, K, subPtr, prefetchBB->getTerminator());
 }
 
 // scratch sub
@@ -428,24 +770,95 @@ void StridePrefetch::insertWSST(Instruction *inst, const double& K) {
   insertPrefetch(inst, K, subPtr, prefetchBB->getTerminator());
 }
 
-// Effects: Recursively calculates the number of instructions executed by loop.
-// Modifies: Updates InstsPerLoopMap 
-unsigned int StridePrefetch::getLoopInstructionCount(const Loop * const loop) {
-  // initialize instsPerLoop entry for loop
-  if (instsPerLoopMap.find(loop) == instsPerLoopMap.end()) {
-    instsPerLoopMap[loop] = 0;
+// scratch sub
+// next = table[stride], the delta that most often followed stride
+// p=(next!=0)
+// p?prefetch(P+next)
+// The table is a select chain over the MARKOV_ENTRIES most frequent
+// correlations, so it stays in registers.
+void StridePrefetch::insertMarkov(Instruction *inst) {
+  LLVMContext &context = Preheader->getParent()->getContext();
+  const Type *Int32Ty = llvm::Type::getInt32Ty(context);
+
+  BinaryOperator *subPtr = scratchAndSub(inst);
+
+  loadInfo *profData = getInfo(inst);
+  Value *next = ConstantInt::get(Int32Ty, 0);
+  unsigned int entries = 0;
+  for (unsigned int i = 0; i < profData->delta_correlations.size() && entries < MARKOV_ENTRIES; i++) {
+    const deltaCorrelation &correlation = profData->delta_correlations[i];
+    if ((double)correlation.count / profData->exec_count <= MARKOV_T) {
+      continue;
+    }
+    ICmpInst *isDelta = new ICmpInst(
+      inst,
+      ICmpInst::ICMP_EQ,
+      subPtr,
+      ConstantInt::get(Int32Ty, correlation.delta),
+      "markovdelta"
+    );
+    next = SelectInst::Create(isDelta, ConstantInt::get(Int32Ty, correlation.next_delta), 
+        next, "markovnext", inst);
+    entries++;
   }
-  else {
-    errs() << "loop was already evaluated\n";
-    return instsPerLoopMap[loop];
+
+  ICmpInst *predicted = new ICmpInst(
+    inst,
+    ICmpInst::ICMP_NE,
+    next,
+    ConstantInt::get(Int32Ty, 0),
+    "markovhit"
+  );
+
+  BasicBlock* homeBB = inst->getParent();
+  BasicBlock* prefetchBB = SplitBlock(homeBB, inst, this);
+  BasicBlock* restBB = SplitBlock(prefetchBB, inst, this);
+
+  BranchInst::Create(prefetchBB, restBB, predicted, homeBB->getTerminator());
+  homeBB->getTerminator()->eraseFromParent(); 
+
+  // a correlation only predicts the next address, no distance scaling
+  Instruction *before = prefetchBB->getTerminator();
+  Value *loadAddr = dyn_cast<LoadInst>(inst)->getPointerOperand();
+  PtrToIntInst *addrInt = new PtrToIntInst(loadAddr, Int32Ty, "ptrtointMarkov", before);
+  BinaryOperator *addition = BinaryOperator::Create(
+      Instruction::Add,
+      addrInt,
+      next,
+      "addition",
+      before
+    );
+  actuallyInsertPrefetch(profData, before, addition, 0);
+}
+
+// Returns the average trip count of L. A constant backedge-taken count is
+// exact; otherwise the ratio of header to preheader executions is used, 
+// which is the profiled average or, in static mode, the estimator's guess.
+int StridePrefetch::getTripCount(Loop *L) {
+  const SCEV *BTC = SE->getBackedgeTakenCount(L);
+  if (const SCEVConstant *C = dyn_cast<SCEVConstant>(BTC)) {
+    return static_cast<int>(C->getValue()->getZExtValue() + 1);
   }
 
-  unsigned int &inst_count = instsPerLoopMap[loop];
+  return static_cast<int>(
+    PI->getExecutionCount(L->getHeader()) / PI->getExecutionCount(Preheader)
+  );
+}
+
+// Effects: Calculates the average number of instructions executed per
+// iteration of loop.
+// Modifies: Caches the result in loopInstCount for the current loop
+unsigned int StridePrefetch::getLoopInstructionCount(const Loop * const loop) {
+  // computed once per runOnLoop, before prefetches change the loop body
+  if (loopInstCount >= 0) {
+    return loopInstCount;
+  }
+
+  double inst_count = 0;
 
   // calculates the average number of instructions executed in the body the loop
   assert(PI->getExecutionCount(loop->getHeader()) > 0 
       && "Execution count shouldn't be negative");
-  double loop_exec_count = PI->getExecutionCount(loop->getHeader());
   for (LoopBase<BasicBlock, Loop>::block_iterator biter = loop->block_begin(), end = loop->block_end(); 
       biter != end; ++biter) {
     assert(PI->getExecutionCount(*biter) >= 0 
@@ -457,7 +870,8 @@ unsigned int StridePrefetch::getLoopInstructionCount(const Loop * const loop) {
     inst_count += block_exec_count * (double)inst_list.size();
   }
 
-  return (double)inst_count / PI->getExecutionCount(loop->getHeader());
+  loopInstCount = (int) (inst_count / PI->getExecutionCount(loop->getHeader()));
+  return loopInstCount;
 }
 
 void StridePrefetch::insertLoad(Instruction *inst) {
@@ -491,6 +905,9 @@ void StridePrefetch::insertLoad(Instruction *inst) {
   else if (WSST_loads.count(inst)) {
     insertWSST(inst, K);
   }
+  else if (MARKOV_loads.count(inst)) {
+    insertMarkov(inst);
+  }
   else {
     errs() << "inst not inserted\n";
   }
@@ -12,8 +12,8 @@ struct timeval t_start, t_end;
 double t_diff;
 
 
-  int i, j, k;
 int main(int argc, char* argv[]) {
+  int i, j, k; // locals so mem2reg turns them into induction variables, A[k] and B[k] are then affine
   if (argc < 2) {
     printf("Put a fucking size!\n");
     return 0;
@@ -0,0 +1,133 @@
+/*
+  A set-associative, LRU, non-inclusive cache hierarchy fed with the
+  addresses of the profiled loads. A hit fills only the levels above the
+  one that hit, and an eviction from one level leaves the line in the
+  others.
+
+  It only sees the instrumented loads, and only while they are profiled:
+  inside the profiling windows, or the sampling windows of the always-on
+  runtime. Stores, other loads and everything in between never touch it,
+  so its miss ratios describe the profiled accesses, not the program, and
+  StridePrefetch only acts on them with -stride-cache-gate.
+*/
+
+#ifndef CACHESIM_H
+#define CACHESIM_H
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "MemoryMap.hxx"
+
+using namespace std;
+
+class CacheLevel {
+
+  public:
+    CacheLevel(uint64_t size, unsigned int assoc, unsigned int line_shift) {
+      lineShift = line_shift;
+      associativity = assoc;
+      numSets = size >> line_shift;
+      numSets = numSets / assoc;
+      if (numSets == 0) {
+        numSets = 1;
+      }
+      tags.resize(numSets * assoc, 0);
+      lastUse.resize(numSets * assoc, 0);
+      useClock = 0;
+    }
+
+    // Looks up the line of addr, true on a hit. A miss replaces the least
+    // recently used way of the set.
+    bool access(uint64_t addr) {
+      const uint64_t line = addr >> lineShift;
+      const uint64_t tag = line + 1; // 0 marks an empty way
+      const uint64_t first = (line % numSets) * associativity;
+
+      uint64_t victim = first;
+      useClock++;
+      for (uint64_t way = first; way < first + associativity; way++) {
+        if (tags[way] == tag) {
+          lastUse[way] = useClock;
+          return true;
+        }
+        if (lastUse[way] < lastUse[victim]) {
+          victim = way;
+        }
+      }
+      tags[victim] = tag;
+      lastUse[victim] = useClock;
+      return false;
+    }
+
+  private:
+    unsigned int lineShift;
+    unsigned int associativity;
+    uint64_t numSets;
+    uint64_t useClock;
+
+    vector<uint64_t> tags;    // numSets * associativity ways, line + 1
+    vector<uint64_t> lastUse; // useClock of the last hit or fill per way
+};
+
+class CacheSim {
+
+  public:
+    // config is "size_kb:assoc,size_kb:assoc,..." from L1 to the LLC
+    CacheSim(const char *config, unsigned int line_shift) {
+      lineShift = line_shift;
+
+      const char *level = config;
+      while (level != NULL && *level != '\0') {
+        unsigned long size_kb;
+        unsigned int assoc;
+        if (sscanf(level, "%lu:%u", &size_kb, &assoc) != 2 || size_kb == 0 || assoc == 0) {
+          fprintf(stderr, "Bad cache level \"%s\" in \"%s\"\n", level, config);
+          abort();
+        }
+        levels.push_back(CacheLevel(size_kb << 10, assoc, line_shift));
+
+        level = strchr(level, ',');
+        if (level != NULL) {
+          level++;
+        }
+      }
+    }
+
+    unsigned int getNumLevels() {
+      return levels.size();
+    }
+
+    // Returns the first level that holds addr, getNumLevels() if it came
+    // from memory. Every level above the hit is filled, lower levels are
+    // left as they are.
+    unsigned int access(uint64_t addr) {
+      unsigned int level;
+      for (level = 0; level < levels.size(); level++) {
+        if (levels[level].access(addr)) {
+          break;
+        }
+      }
+      return level;
+    }
+
+    // True the first time the line of addr is accessed. One byte of the
+    // map stands for one line, so a page covers 4096 lines.
+    bool isColdMiss(uint64_t addr) {
+      const void *line = (const void *) (intptr_t) (addr >> lineShift);
+      if (touchedLines.is_valid<uint8_t>(line)) {
+        return false;
+      }
+      touchedLines.set_valid<uint8_t>(line);
+      return true;
+    }
+
+  private:
+    unsigned int lineShift;
+    vector<CacheLevel> levels;
+    Memory::MemoryNodeMap<uint8_t> touchedLines;
+};
+
+#endif
@@ -8,12 +8,106 @@
 #include <utility>
 #include <map>
 #include <algorithm>
+#include <cstdlib>
 
 #include "loadstride.hxx"
 
 using namespace std;
 
 unsigned int LoadStride::TOPCOUNT = 4; // number of top stride values to return (not including zero)
+unsigned int LoadStride::GRANULE_SHIFT = 4;
+unsigned int LoadStride::LINE_SHIFT = 6;
+bool LoadStride::CORRELATION = false;
+
+static bool compareCountDesc(const pair<long, long> &a, const pair<long, long> &b) {
+  return a.second > b.second;
+}
+
+int LoadStride::logBucket(long stride) {
+  if (stride == 0) {
+    return 0;
+  }
+  unsigned long magnitude = stride < 0 ? -stride : stride;
+  int bucket = 0;
+  while (magnitude != 0) {
+    magnitude >>= 1;
+    bucket++;
+  }
+  return stride < 0 ? -bucket : bucket;
+}
+
+void LoadStride::getStrideDistribution(unsigned int n, vector< pair<long, long> > &top,
+    map<int, long> &histogram) {
+  vector< pair<long, long> > all(strideValuesToCount.begin(), strideValuesToCount.end());
+  sort(all.begin(), all.end(), compareCountDesc);
+
+  for (unsigned int i = 0; i < all.size(); i++) {
+    if (i < n) {
+      top.push_back(all[i]);
+    } else {
+      histogram[logBucket(all[i].first)] += all[i].second;
+    }
+  }
+}
+
+void LoadStride::getTopLineStrides(unsigned int n, vector< pair<long, long> > &top) {
+  vector< pair<long, long> > all(lineStridesToCount.begin(), lineStridesToCount.end());
+  sort(all.begin(), all.end(), compareCountDesc);
+
+  for (unsigned int i = 0; i < all.size() && i < n; i++) {
+    top.push_back(all[i]);
+  }
+}
+
+static bool compareCorrelationDesc(const pair< pair<long, long>, long > &a, 
+    const pair< pair<long, long>, long > &b) {
+  return a.second > b.second;
+}
+
+void LoadStride::getDeltaCorrelations(unsigned int n, vector< pair< pair<long, long>, long > > &top) {
+  // keep only the most frequent successor of every stride
+  vector< pair< pair<long, long>, long > > successors;
+  map< pair<long, long>, long >::iterator itStart, itEnd;
+  for (itStart = deltaPairsToCount.begin(), itEnd = deltaPairsToCount.end(); itStart != itEnd;
+       itStart++) {
+    if (successors.empty() || successors.back().first.first != itStart->first.first) {
+      successors.push_back(*itStart);
+    } else if (itStart->second > successors.back().second) {
+      successors.back() = *itStart;
+    }
+  }
+  sort(successors.begin(), successors.end(), compareCorrelationDesc);
+
+  for (unsigned int i = 0; i < successors.size() && i < n; i++) {
+    top.push_back(successors[i]);
+  }
+}
+
+void LoadStride::addCacheAccess(unsigned int level, unsigned int num_levels, bool cold) {
+  if (cacheLevelHits.empty()) {
+    cacheLevelHits.resize(num_levels + 1, 0);
+  }
+  cacheLevelHits[level]++;
+  if (cold) {
+    coldMisses++;
+  }
+}
+
+void LoadStride::getCacheMisses(vector< pair<long, long> > &misses) {
+  if (cacheLevelHits.empty()) {
+    return;
+  }
+
+  long accesses = 0;
+  for (unsigned int i = 0; i < cacheLevelHits.size(); i++) {
+    accesses += cacheLevelHits[i];
+  }
+  for (unsigned int i = 0; i + 1 < cacheLevelHits.size(); i++) {
+    misses.push_back(make_pair(accesses, accesses - cacheLevelHits[i]));
+    accesses -= cacheLevelHits[i];
+  }
+  misses.push_back(make_pair(accesses, coldMisses));
+}
 
 LoadStride::LoadStride(uint32_t load_id, int32_t exec_count) {
   loadID = load_id;
@@ -22,6 +116,9 @@ LoadStride::LoadStride(uint32_t load_id, int32_t exec_count) {
   strideZeroDifferenceCount = 0;
   topStrideHolder = make_pair(-1, -1);
   lastAddress = -1;
+  coldMisses = 0;
+  strideCount = 0;
+  lastStride = 0;
 
   cout << "looking at load_id: "<<load_id<<"\n";
   //cout << "exec_count <" << exec_count << "> " << "profile <" << profileN << "> skip<" << skipN << ">\n";
@@ -72,36 +169,50 @@ void LoadStride::addAddress(uint64_t addr) {
   unsigned long last_address = lastAddress;
   lastAddress = addr;
 
+  lineStridesToCount[(long) (addr >> LINE_SHIFT) - (long) (last_address >> LINE_SHIFT)]++;
+
   long stride = addr - last_address;
   if (stride == 0 || isSameValue(addr, last_address)) {
     strideZeroCount++;
     return;
   }
 
-  if (strideValues.size() == 0) {
-    strideValues.push_back(stride);
-    if (strideValuesToCount.count(stride)) {
-      strideValuesToCount[stride]++;
-    } else {
-      strideValuesToCount[stride] = 1;
-    }
-    updateTopStrideValues(stride);
+  recordStride(stride, 1);
+}
+
+void LoadStride::addStrides(long stride, unsigned long count) {
+  if (count == 0) {
     return;
   }
+  lineStridesToCount[stride >> LINE_SHIFT] += count;
 
-  long last_stride = strideValues.back();
-  strideValues.push_back(stride);
-  if (strideValuesToCount.count(stride)) {
-    strideValuesToCount[stride]++;
-  } else {
-    strideValuesToCount[stride] = 1;
+  // strides within a granule count as 0, like addresses in one granule
+  if ((labs(stride) >> GRANULE_SHIFT) == 0) {
+    strideZeroCount += count;
+    return;
   }
-  updateTopStrideValues(stride);
 
-  long strideDifference = stride - last_stride;
-  if (strideDifference == 0) {
-    strideZeroDifferenceCount++;
-  }
+  recordStride(stride, count);
 }
 
+void LoadStride::recordStride(long stride, unsigned long count) {
+  strideValuesToCount[stride] += count;
+  updateTopStrideValues(stride);
+
+  if (strideCount != 0) {
+    if (CORRELATION) {
+      deltaPairsToCount[make_pair(lastStride, stride)]++;
+    }
+    if (stride == lastStride) {
+      strideZeroDifferenceCount++;
+    }
+  }
+  if (CORRELATION && count > 1) {
+    deltaPairsToCount[make_pair(stride, stride)] += count - 1;
+  }
+  // the repeats after the first all have a stride difference of 0
+  strideZeroDifferenceCount += count - 1;
 
+  strideCount += count;
+  lastStride = stride;
+}
@@ -13,6 +13,10 @@ class LoadStride {
     ~LoadStride();
 
     void addAddress(uint64_t);
+
+    // Records count consecutive strides of the same value, for profile
+    // sources that see strides rather than every address (stride-sampler).
+    void addStrides(long stride, unsigned long count);
     
     unsigned long getStrideZeroCount() {
       return strideZeroCount;
@@ -39,7 +43,7 @@ class LoadStride {
     }
 
     unsigned int getStrideExecCount() {
-      return strideValues.size();
+      return strideCount;
     }
 
     void clearAddresses() {
@@ -48,19 +52,63 @@ class LoadStride {
 
     bool isSameValue(long value1, long value2) {
       // value1 and value2 are treated to be the same vlaue
-      // if they only are different in the last 4 bits
-      return (value1 >> 4 == value2 >> 4);
+      // if they only are different in the last GRANULE_SHIFT bits
+      return (value1 >> GRANULE_SHIFT == value2 >> GRANULE_SHIFT);
+    }
+
+    // The n most frequent strides as <value, count>, most frequent first,
+    // and a histogram of all other strides keyed by logBucket(stride).
+    void getStrideDistribution(unsigned int n, vector< pair<long, long> > &top,
+        map<int, long> &histogram);
+
+    // The n most frequent strides measured in cache lines.
+    void getTopLineStrides(unsigned int n, vector< pair<long, long> > &top);
+
+    // For each stride, the stride that most often followed it as
+    // <<stride, next_stride>, count>, the n most frequent first. Only
+    // recorded when the correlation mode is on.
+    void getDeltaCorrelations(unsigned int n, vector< pair< pair<long, long>, long > > &top);
+
+    // level is where the cache simulator found the address, num_levels if
+    // it came from memory; cold is set for the first access to its line
+    void addCacheAccess(unsigned int level, unsigned int num_levels, bool cold);
+
+    // <accesses, misses> of every simulated level from L1 to the LLC,
+    // followed by <LLC misses, cold misses>. Empty without the simulator.
+    void getCacheMisses(vector< pair<long, long> > &misses);
+
+    // sign(stride) * (floor(log2(|stride|)) + 1), 0 for a stride of 0
+    static int logBucket(long stride);
+
+    static void setGranuleShift(unsigned int shift) {
+      GRANULE_SHIFT = shift;
+    }
+
+    static void setLineShift(unsigned int shift) {
+      LINE_SHIFT = shift;
+    }
+
+    static void setCorrelation(bool enabled) {
+      CORRELATION = enabled;
     }
 
   private:
     static unsigned int TOPCOUNT;
+    static unsigned int GRANULE_SHIFT; // addresses in one granule have stride 0
+    static unsigned int LINE_SHIFT;    // log2 of the cache line size
+    static bool CORRELATION;           // record which stride follows which
 
     uint32_t loadID;
     uint32_t executionCount;
     long lastAddress;
 
-    vector<long> strideValues;
+    unsigned long strideCount; // non-zero strides seen
+    long lastStride;           // previous non-zero stride, valid if strideCount
     map<long, long> strideValuesToCount;
+    map<long, long> lineStridesToCount;
+    map< pair<long, long>, long > deltaPairsToCount; // <stride, next stride> -> count
+    vector<long> cacheLevelHits; // accesses served by each level, memory last
+    long coldMisses;
     unsigned long strideZeroCount;
     unsigned long strideZeroDifferenceCount;
 
@@ -69,5 +117,6 @@ class LoadStride {
     pair<long, long> topStrideHolder;
     
     void updateTopStrideValues(long);
+    void recordStride(long stride, unsigned long count);
 };
 #endif
@@ -2,6 +2,7 @@
 
 #include "stride_hooks.hxx"
 #include "loadstride.hxx"
+#include "cachesim.hxx"
 
 #include <cassert>
 #include <stdio.h>
@@ -10,8 +11,19 @@
 #include <iomanip>
 #include <fstream>
 #include <map>
+#include <set>
 #include <vector>
 
+#ifdef STRIDE_SAMPLED
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <new>
+
+#include "Locks.hxx"
+#endif
+
 using namespace std;
 
 using namespace __gnu_cxx;
@@ -20,23 +32,10 @@ using namespace __gnu_cxx;
 
 bool Stride_initialized =0;
 
-static uint64_t time_stamp;
-
-typedef struct timestamp_s {
-    uint32_t instr:20;
-    uint64_t timestamp:44;
-} __attribute__((__packed__)) timestamp_t;
-
-static const uint64_t TIME_STAMP_MAX = ((1ULL << 44) - 1);
-static const uint64_t INSTR_MAX = ((1ULL << 20) - 1);
-
-bool operator==(const timestamp_t &t1, const timestamp_t &t2) {
-    return *((uint64_t *) &t1) == *((uint64_t *) &t2);
-}
-
 static const uint64_t MAX_DEP_DIST = 2;
 
 map<uint32_t, LoadStride *> StrideProfiles;
+map<uint32_t, uint32_t> FunctionChecksums; // function id -> CFG checksum
 
 /***** struct defs *****/
 typedef struct _stride_params_t {
@@ -47,6 +46,9 @@ typedef struct _stride_params_t {
     bool measure_iterations;
     bool profile_flow;
     bool profile_output;
+    uint32_t top_n;          // strides exported with their counts
+    bool profile_correlation; // export stride -> next stride correlations
+    CacheSim *cache;          // simulated hierarchy, NULL unless STRIDE_CACHE is set
 } stride_params_t;
 
 typedef struct _stride_stats_t {
@@ -57,6 +59,58 @@ typedef struct _stride_stats_t {
 static stride_params_t stride_params;
 static stride_stats_t stride_stats;
 
+#ifdef STRIDE_SAMPLED
+/*
+  Always-on sampling: a background thread arms the hooks for a short window
+  every period. Disarmed, Stride_StrideProfile is a single predictable
+  branch; armed, it appends to a ring owned by the calling thread. The
+  background thread drains the rings into StrideProfiles and periodically
+  writes a snapshot of the profile.
+*/
+
+typedef struct _stride_record_t {
+    uint32_t load_id;
+    int32_t exec_count;
+    uint64_t addr;       // STRIDE_CLEAR_ADDRESS for Stride_StrideProfile_ClearAddresses
+    uint32_t window;     // sampling window the record was taken in
+} stride_record_t;
+
+static const uint64_t STRIDE_CLEAR_ADDRESS = 0;
+static const uint32_t STRIDE_ALL_LOADS = ~0U; // clears every load of the ring
+static const uint32_t RING_SIZE = 4096; // records per thread, power of 2
+
+// produced by the owning thread, consumed by the drain thread
+typedef struct _stride_ring_t {
+    Locks::SPSCRing<stride_record_t, RING_SIZE> records;
+    uint64_t dropped;    // records lost to a full ring, only the owner stores it
+    bool gap;            // records were dropped since the last push
+    struct _stride_ring_t *next;
+} stride_ring_t;
+
+typedef struct _stride_sampling_t {
+    uint64_t period_us;  // time between windows
+    uint64_t window_us;  // time the hooks stay armed
+    uint64_t snapshot_s; // time between profile snapshots
+    pthread_t drain;
+    pthread_mutex_t profiles_lock; // StrideProfiles, FunctionChecksums
+    bool stop;
+} stride_sampling_t;
+
+// written by the drain thread only; Stride_window is bumped before the
+// release store that arms the hooks, which load Stride_armed with acquire
+static bool Stride_armed = 0;
+static uint32_t Stride_window = 0;   // incremented every time the hooks are armed
+static map<uint32_t, uint32_t> LoadWindows;   // load id -> window of its last drained record
+static stride_ring_t *all_rings = NULL; // every thread's ring, never freed
+static __thread stride_ring_t *thread_ring = NULL;
+static stride_sampling_t stride_sampling;
+
+static void start_sampling();
+static void stop_sampling();
+static void drain_rings();
+static void write_snapshot();
+#endif
+
 struct nullstream: std::ostream {
     struct nullbuf: std::streambuf {
 	int overflow(int c) { return traits_type::not_eof(c); }
@@ -98,10 +152,61 @@ void Stride_print_StrideProfile(ofstream &stream) {
       stream << "0 ";
     }
 
+    // full distribution: T <n> (stride count)* H <m> (bucket count)* L <k> (line_stride count)*
+    vector< pair<long, long> > top;
+    map<int, long> histogram;
+    loadStride->getStrideDistribution(stride_params.top_n, top, histogram);
+
+    stream << "T " << top.size() << " ";
+    for (unsigned int i = 0; i < top.size(); i++) {
+      stream << top[i].first << " " << top[i].second << " ";
+    }
+
+    stream << "H " << histogram.size() << " ";
+    for (map<int, long>::iterator hist = histogram.begin(); hist != histogram.end(); hist++) {
+      stream << hist->first << " " << hist->second << " ";
+    }
+
+    vector< pair<long, long> > lines;
+    loadStride->getTopLineStrides(stride_params.top_n, lines);
+    stream << "L " << lines.size();
+    for (unsigned int i = 0; i < lines.size(); i++) {
+      stream << " " << lines[i].first << " " << lines[i].second;
+    }
+
+    // delta correlations: C <j> (stride next_stride count)*
+    if (stride_params.profile_correlation) {
+      vector< pair< pair<long, long>, long > > correlations;
+      loadStride->getDeltaCorrelations(stride_params.top_n, correlations);
+      stream << " C " << correlations.size();
+      for (unsigned int i = 0; i < correlations.size(); i++) {
+        stream << " " << correlations[i].first.first << " " << correlations[i].first.second
+               << " " << correlations[i].second;
+      }
+    }
+
+    // simulated misses: M <n> (accesses misses)*, L1 to LLC then (LLC misses, cold misses)
+    if (stride_params.cache != NULL) {
+      vector< pair<long, long> > misses;
+      loadStride->getCacheMisses(misses);
+      stream << " M " << misses.size();
+      for (unsigned int i = 0; i < misses.size(); i++) {
+        stream << " " << misses[i].first << " " << misses[i].second;
+      }
+    }
+
     stream << endl;
   }
 
   stream << "STRIDEPROFILE_END" << endl;
+
+  stream << "CHECKSUM_START" << endl;
+  map<uint32_t, uint32_t>::iterator csStart, csEnd;
+  for (csStart = FunctionChecksums.begin(), csEnd = FunctionChecksums.end(); csStart != csEnd;
+       csStart++) {
+    stream << csStart->first << " " << csStart->second << endl;
+  }
+  stream << "CHECKSUM_END" << endl;
 }
 
 void Stride_print_stats(ofstream &stream) {
@@ -111,41 +216,278 @@ void Stride_print_stats(ofstream &stream) {
 
 /***** functions *****/
 void Stride_init() {
+#ifndef STRIDE_SAMPLED
     stride_params.stride_out = new ofstream("result.stride.profile");
-    
-		if (sizeof(timestamp_t) != sizeof(uint64_t)) {
-        fprintf(stderr, "sizeof(timestamp_t) != sizeof(uint64_t) (%lu != %lu)\n", sizeof(timestamp_t), sizeof(uint64_t));
-        abort();
+#endif
+
+    stride_params.top_n = 8;
+    if (getenv("STRIDE_TOP_N") != NULL) {
+        stride_params.top_n = atoi(getenv("STRIDE_TOP_N"));
+    }
+    if (getenv("STRIDE_GRANULE_BITS") != NULL) {
+        LoadStride::setGranuleShift(atoi(getenv("STRIDE_GRANULE_BITS")));
+    }
+    if (getenv("STRIDE_LINE_BITS") != NULL) {
+        LoadStride::setLineShift(atoi(getenv("STRIDE_LINE_BITS")));
+    }
+    stride_params.profile_correlation = false;
+    if (getenv("STRIDE_CORRELATION") != NULL) {
+        stride_params.profile_correlation = atoi(getenv("STRIDE_CORRELATION")) != 0;
+        LoadStride::setCorrelation(stride_params.profile_correlation);
+    }
+    stride_params.cache = NULL;
+    if (getenv("STRIDE_CACHE") != NULL) {
+        // "1" picks a typical 32K/256K/8M hierarchy
+        const char *config = getenv("STRIDE_CACHE");
+        if (strcmp(config, "1") == 0) {
+            config = "32:8,256:8,8192:16";
+        }
+        unsigned int line_shift = 6;
+        if (getenv("STRIDE_LINE_BITS") != NULL) {
+            line_shift = atoi(getenv("STRIDE_LINE_BITS"));
+        }
+        stride_params.cache = new CacheSim(config, line_shift);
     }
 
     stride_stats.start_time = clock();
     stride_stats.num_sync_arcs = 0;
- 
-    time_stamp = 1;
 
 		Stride_initialized = 1;
 
+#ifdef STRIDE_SAMPLED
+    start_sampling();
+#endif
+
     atexit(Stride_finish);
 }
 
 void Stride_finish() {
+#ifdef STRIDE_SAMPLED
+    stop_sampling();
+    pthread_mutex_lock(&stride_sampling.profiles_lock);
+    drain_rings();
+    write_snapshot();
+    pthread_mutex_unlock(&stride_sampling.profiles_lock);
+#else
     Stride_print_StrideProfile(*(stride_params.stride_out));
+#endif
+}
+
+static void record_address(const uint32_t load_id, const uint64_t addr, const int32_t exec_count) {
+  if (StrideProfiles.count(load_id) == 0) {
+    StrideProfiles[load_id] = new LoadStride(load_id, exec_count);
+  }
+
+  LoadStride *profiler = StrideProfiles[load_id];
+  profiler->addAddress(addr);
+
+  if (stride_params.cache != NULL) {
+    CacheSim *cache = stride_params.cache;
+    bool cold = cache->isColdMiss(addr);
+    profiler->addCacheAccess(cache->access(addr), cache->getNumLevels(), cold);
+  }
+}
+
+#ifndef STRIDE_SAMPLED
+void Stride_StrideProfile(const uint32_t load_id, const uint64_t addr, const int32_t exec_count) {
+  if (!Stride_initialized) {
+    return;
+  }
+
+  record_address(load_id, addr, exec_count);
+}
+#else
+static stride_ring_t *create_ring() {
+  // operator new ignores the cache line alignment of SPSCRing's head and tail
+  void *memory;
+  if (posix_memalign(&memory, Locks::CACHE_LINE_SIZE, sizeof(stride_ring_t)) != 0) {
+    fprintf(stderr, "Could not allocate a stride sampling ring\n");
+    abort();
+  }
+  stride_ring_t *ring = new (memory) stride_ring_t;
+  ring->dropped = 0;
+  ring->gap = false;
+  stride_ring_t *first;
+  do {
+    first = __atomic_load_n(&all_rings, __ATOMIC_ACQUIRE);
+    ring->next = first;
+  } while (!__atomic_compare_exchange_n(&all_rings, &first, ring, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  return ring;
+}
+
+static void ring_push(const uint32_t load_id, const uint64_t addr, const int32_t exec_count) {
+  stride_ring_t *ring = thread_ring;
+  if (ring == NULL) {
+    ring = thread_ring = create_ring();
+  }
+
+  const uint32_t window = __atomic_load_n(&Stride_window, __ATOMIC_RELAXED);
+  if (ring->gap) {
+    // no stride may span the dropped records
+    if (ring->records.size() + 2 > RING_SIZE) {
+      ring->dropped++;
+      return;
+    }
+    stride_record_t clear;
+    clear.load_id = STRIDE_ALL_LOADS;
+    clear.exec_count = 0;
+    clear.addr = STRIDE_CLEAR_ADDRESS;
+    clear.window = window;
+    ring->records.push(clear);
+    ring->gap = false;
+  }
+
+  stride_record_t record;
+  record.load_id = load_id;
+  record.exec_count = exec_count;
+  record.addr = addr;
+  record.window = window;
+  if (!ring->records.push(record)) {
+    ring->dropped++;
+    ring->gap = true;
+  }
 }
 
 void Stride_StrideProfile(const uint32_t load_id, const uint64_t addr, const int32_t exec_count) {
+  if (__builtin_expect(!__atomic_load_n(&Stride_armed, __ATOMIC_ACQUIRE), 1)) {
+    return;
+  }
+
+  ring_push(load_id, addr, exec_count);
+}
+
+// Moves every complete record into StrideProfiles, profiles_lock held.
+static void drain_rings() {
+  for (stride_ring_t *ring = __atomic_load_n(&all_rings, __ATOMIC_ACQUIRE); ring != NULL;
+       ring = ring->next) {
+    set<uint32_t> loads;
+    stride_record_t record;
+    while (ring->records.pop(record)) {
+      if (record.addr != STRIDE_CLEAR_ADDRESS) {
+        // a hook still running when its window closed may be drained
+        // after the window's other records
+        map<uint32_t, uint32_t>::iterator window = LoadWindows.find(record.load_id);
+        if (window == LoadWindows.end() || window->second != record.window) {
+          if (StrideProfiles.count(record.load_id)) {
+            StrideProfiles[record.load_id]->clearAddresses();
+          }
+          LoadWindows[record.load_id] = record.window;
+        }
+        record_address(record.load_id, record.addr, record.exec_count);
+        loads.insert(record.load_id);
+      } else if (record.load_id == STRIDE_ALL_LOADS) {
+        for (set<uint32_t>::iterator load = loads.begin(); load != loads.end(); load++) {
+          StrideProfiles[*load]->clearAddresses();
+        }
+      } else if (StrideProfiles.count(record.load_id)) {
+        StrideProfiles[record.load_id]->clearAddresses();
+      }
+    }
+
+    // strides never span two windows or two threads
+    for (set<uint32_t>::iterator load = loads.begin(); load != loads.end(); load++) {
+      StrideProfiles[*load]->clearAddresses();
+    }
+  }
+}
+
+// Replaces result.stride.profile in one step so readers never see half a
+// profile, profiles_lock held.
+static void write_snapshot() {
+  {
+    ofstream snapshot("result.stride.profile.snapshot");
+    Stride_print_StrideProfile(snapshot);
+  }
+  rename("result.stride.profile.snapshot", "result.stride.profile");
+}
+
+static void *drain_thread(void *) {
+  time_t last_snapshot = time(NULL);
+  while (!__atomic_load_n(&stride_sampling.stop, __ATOMIC_ACQUIRE)) {
+    usleep(stride_sampling.period_us);
+    __atomic_store_n(&Stride_window, Stride_window + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&Stride_armed, true, __ATOMIC_RELEASE);
+    usleep(stride_sampling.window_us);
+    __atomic_store_n(&Stride_armed, false, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&stride_sampling.profiles_lock);
+    drain_rings();
+    if (stride_sampling.snapshot_s > 0 && 
+        (uint64_t) (time(NULL) - last_snapshot) >= stride_sampling.snapshot_s) {
+      write_snapshot();
+      last_snapshot = time(NULL);
+    }
+    pthread_mutex_unlock(&stride_sampling.profiles_lock);
+  }
+  return NULL;
+}
+
+static void start_sampling() {
+  stride_sampling.period_us = 100000;
+  stride_sampling.window_us = 1000;
+  stride_sampling.snapshot_s = 10;
+  if (getenv("STRIDE_SAMPLE_PERIOD_US") != NULL) {
+    stride_sampling.period_us = strtoull(getenv("STRIDE_SAMPLE_PERIOD_US"), NULL, 0);
+  }
+  if (getenv("STRIDE_SAMPLE_WINDOW_US") != NULL) {
+    stride_sampling.window_us = strtoull(getenv("STRIDE_SAMPLE_WINDOW_US"), NULL, 0);
+  }
+  if (getenv("STRIDE_SNAPSHOT_SECS") != NULL) {
+    stride_sampling.snapshot_s = strtoull(getenv("STRIDE_SNAPSHOT_SECS"), NULL, 0);
+  }
+
+  stride_sampling.stop = false;
+  pthread_mutex_init(&stride_sampling.profiles_lock, NULL);
+  if (pthread_create(&stride_sampling.drain, NULL, drain_thread, NULL) != 0) {
+    fprintf(stderr, "Could not start the stride sampling thread\n");
+    abort();
+  }
+}
+
+static void stop_sampling() {
+  __atomic_store_n(&stride_sampling.stop, true, __ATOMIC_RELEASE);
+  pthread_join(stride_sampling.drain, NULL);
+  __atomic_store_n(&Stride_armed, false, __ATOMIC_RELEASE);
+
+  uint64_t dropped = 0;
+  for (stride_ring_t *ring = all_rings; ring != NULL; ring = ring->next) {
+    dropped += ring->dropped;
+  }
+  if (dropped > 0) {
+    fprintf(stderr, "stride sampling: %" PRIu64 " records dropped, shorten STRIDE_SAMPLE_WINDOW_US\n", dropped);
+  }
+}
+#endif
+
+// For collectors that reconstruct strides instead of calling
+// Stride_StrideProfile on every address.
+void Stride_StrideProfile_AddStrides(const uint32_t load_id, const int64_t stride, const uint64_t count, const int32_t exec_count) {
   if (!Stride_initialized) {
     return;
   }
 
+#ifdef STRIDE_SAMPLED
+  pthread_mutex_lock(&stride_sampling.profiles_lock);
+#endif
   if (StrideProfiles.count(load_id) == 0) {
     StrideProfiles[load_id] = new LoadStride(load_id, exec_count);
   }
 
-  LoadStride *profiler = StrideProfiles[load_id];
-  profiler->addAddress(addr);
+  StrideProfiles[load_id]->addStrides(stride, count);
+#ifdef STRIDE_SAMPLED
+  pthread_mutex_unlock(&stride_sampling.profiles_lock);
+#endif
 }
 
 void Stride_StrideProfile_ClearAddresses(const uint32_t load_id) {
+#ifdef STRIDE_SAMPLED
+  if (__builtin_expect(!__atomic_load_n(&Stride_armed, __ATOMIC_ACQUIRE), 1)) {
+    return;
+  }
+  ring_push(load_id, STRIDE_CLEAR_ADDRESS, 0);
+  return;
+#endif
   if (!Stride_initialized) {
     return;
   }
@@ -155,3 +497,13 @@ void Stride_StrideProfile_ClearAddresses(const uint32_t load_id) {
   StrideProfiles[load_id]->clearAddresses();
 }
 
+
+void Stride_RecordChecksum(const uint32_t function_id, const uint32_t checksum) {
+#ifdef STRIDE_SAMPLED
+  pthread_mutex_lock(&stride_sampling.profiles_lock);
+#endif
+  FunctionChecksums[function_id] = checksum;
+#ifdef STRIDE_SAMPLED
+  pthread_mutex_unlock(&stride_sampling.profiles_lock);
+#endif
+}
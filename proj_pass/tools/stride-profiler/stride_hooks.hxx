@@ -15,6 +15,8 @@ void Stride_init();
 
 void Stride_StrideProfile(const uint32_t load_id, const uint64_t addr, const int32_t exec_count);
 void Stride_StrideProfile_ClearAddresses(const uint32_t load_id);
+void Stride_StrideProfile_AddStrides(const uint32_t load_id, const int64_t stride, const uint64_t count, const int32_t exec_count);
+void Stride_RecordChecksum(const uint32_t function_id, const uint32_t checksum);
 
 void Stride_finish(void);
 
@@ -0,0 +1,561 @@
+/*
+  Stride profiling without instrumentation: samples the data address of
+  retired loads with perf_event_open (precise, PEBS on Intel) while the
+  unmodified program runs, attributes the samples to load ids through the
+  debug line info and writes the usual result.stride.profile.
+
+  stride-sampler [-p period] [-e raw_event] [-s sites_file] -- program args...
+
+  The program must be built with -g from the bitcode -emit-stride-sites ran
+  on, so that its load ids match those of result.stride.sites.
+*/
+
+#define __STDC_FORMAT_MACROS
+
+#include "stride_hooks.hxx"
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+/**** configuration ****/
+
+static const uint64_t DEFAULT_PERIOD = 10007;   // prime, so loops do not alias with it
+static const uint64_t DEFAULT_EVENT = 0x81d0;   // MEM_INST_RETIRED.ALL_LOADS
+static const unsigned int RING_PAGES = 64;      // data pages of the sample ring, power of 2
+static const long MIN_STRIDE = 4;               // smaller reconstructed strides are noise
+
+typedef struct _sample_t {
+    uint64_t ip;
+    uint64_t time;
+    uint64_t addr;
+    uint32_t tid;
+} sample_t;
+
+static bool sample_before(const sample_t &a, const sample_t &b) {
+    return a.time < b.time;
+}
+
+typedef struct _site_t {
+    uint32_t load_id;
+    unsigned int col;
+} site_t;
+
+typedef struct _sampler_t {
+    pid_t child;
+    vector<int> fds;     // one counter per cpu, inherited counters cannot be mapped per task
+    vector<struct perf_event_mmap_page *> rings;
+    uint64_t ring_size;
+    string exe;          // path of the sampled executable
+    map<uint64_t, uint64_t> segments;   // page offset -> vaddr of the load segments of a PIE
+    uint64_t exe_base;   // load address of a position independent exe, else 0
+    bool found_base;
+    vector<sample_t> samples;
+} sampler_t;
+
+static sampler_t sampler;
+
+// (function, line) -> loads at that location
+static map< pair<string, unsigned int>, vector<site_t> > Sites;
+static vector< pair<uint32_t, uint32_t> > Checksums;
+
+static long perf_event_open(struct perf_event_attr *attr, pid_t pid, int cpu, int group_fd,
+                            unsigned long flags) {
+    return syscall(__NR_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+static void usage() {
+    fprintf(stderr, "usage: stride-sampler [-p period] [-e raw_event] [-s sites_file] -- program args...\n");
+    exit(1);
+}
+
+/***** load sites *****/
+
+static void read_sites(const char *path) {
+    ifstream in(path);
+    if (!in) {
+        fprintf(stderr, "Could not open %s, run -emit-stride-sites first\n", path);
+        exit(1);
+    }
+
+    string s;
+    bool in_sites = false, in_checksums = false;
+    while (getline(in, s)) {
+        if (s == "SITES_START") { in_sites = true; continue; }
+        if (s == "SITES_END") { in_sites = false; continue; }
+        if (s == "CHECKSUM_START") { in_checksums = true; continue; }
+        if (s == "CHECKSUM_END") { in_checksums = false; continue; }
+
+        istringstream iss(s);
+        if (in_sites) {
+            site_t site;
+            string function;
+            unsigned int line;
+            if (iss >> site.load_id >> function >> line >> site.col) {
+                Sites[make_pair(function, line)].push_back(site);
+            }
+        } else if (in_checksums) {
+            uint32_t function_id, checksum;
+            if (iss >> function_id >> checksum) {
+                Checksums.push_back(make_pair(function_id, checksum));
+            }
+        }
+    }
+}
+
+/***** sampling *****/
+
+// Finds the executable the child will run the way execvp would, so that
+// nothing about it has to be read from /proc once the child is running.
+static string find_exe(const char *name) {
+    vector<string> candidates;
+    if (strchr(name, '/') != NULL) {
+        candidates.push_back(name);
+    } else {
+        const char *path = getenv("PATH");
+        istringstream dirs(path != NULL ? path : "/bin:/usr/bin");
+        string dir;
+        while (getline(dirs, dir, ':')) {
+            candidates.push_back((dir.empty() ? string(".") : dir) + "/" + name);
+        }
+    }
+
+    for (unsigned int i = 0; i < candidates.size(); i++) {
+        char exe[PATH_MAX];
+        if (access(candidates[i].c_str(), X_OK) == 0 && realpath(candidates[i].c_str(), exe) != NULL) {
+            return exe;
+        }
+    }
+    fprintf(stderr, "Could not find %s\n", name);
+    exit(1);
+}
+
+// Reads the load segments of a position independent executable, their
+// mappings reported by the kernel give its load address.
+static void read_segments() {
+    FILE *fp = fopen(sampler.exe.c_str(), "rb");
+    Elf64_Ehdr header;
+    if (fp == NULL || fread(&header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header.e_ident, ELFMAG, SELFMAG) != 0 || header.e_ident[EI_CLASS] != ELFCLASS64) {
+        fprintf(stderr, "%s is not a 64 bit ELF executable\n", sampler.exe.c_str());
+        exit(1);
+    }
+
+    if (header.e_type == ET_DYN) {
+        const uint64_t page_mask = ~((uint64_t) sysconf(_SC_PAGESIZE) - 1);
+        for (unsigned int i = 0; i < header.e_phnum; i++) {
+            Elf64_Phdr segment;
+            if (fseek(fp, header.e_phoff + i * header.e_phentsize, SEEK_SET) != 0 ||
+                fread(&segment, sizeof(segment), 1, fp) != 1) {
+                break;
+            }
+            if (segment.p_type == PT_LOAD) {
+                sampler.segments[segment.p_offset & page_mask] = segment.p_vaddr & page_mask;
+            }
+        }
+    }
+    fclose(fp);
+}
+
+// Takes the load address of the executable from the mapping of one of its
+// segments.
+static void record_mmap(const uint8_t *body) {
+    // struct { pid, tid; addr, len, pgoff; maj, min; ino, ino_generation; prot, flags; filename[] }
+    const uint64_t addr = *((const uint64_t *) (body + 8));
+    const uint64_t pgoff = *((const uint64_t *) (body + 24));
+    const char *filename = (const char *) (body + 64);
+
+    map<uint64_t, uint64_t>::iterator segment = sampler.segments.find(pgoff);
+    if (!sampler.found_base && segment != sampler.segments.end() && sampler.exe == filename) {
+        sampler.exe_base = addr - segment->second;
+        sampler.found_base = true;
+    }
+}
+
+// Moves the complete records of a ring into sampler.samples.
+static void drain_ring(struct perf_event_mmap_page *meta) {
+    uint8_t *data = ((uint8_t *) meta) + sysconf(_SC_PAGESIZE);
+    const uint64_t mask = sampler.ring_size - 1;
+
+    uint64_t head = meta->data_head;
+    __sync_synchronize();
+    uint64_t tail = meta->data_tail;
+
+    static uint8_t record[1 << 16]; // header.size is 16 bits
+    while (tail < head) {
+        struct perf_event_header header;
+        for (unsigned int i = 0; i < sizeof(header); i++) {
+            ((uint8_t *) &header)[i] = data[(tail + i) & mask];
+        }
+        if (header.size < sizeof(header)) {
+            tail = head; // corrupt record, drop what is left
+            break;
+        }
+        for (unsigned int i = 0; i < header.size; i++) {
+            record[i] = data[(tail + i) & mask];
+        }
+        tail += header.size;
+
+        if (header.type == PERF_RECORD_MMAP2 && header.size > sizeof(header) + 64) {
+            record[header.size - 1] = '\0';
+            record_mmap(record + sizeof(header));
+        }
+        if (header.type != PERF_RECORD_SAMPLE) {
+            continue;
+        }
+
+        // PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_ADDR, in that order
+        const uint8_t *body = record + sizeof(header);
+        sample_t sample;
+        sample.ip = *((const uint64_t *) body);
+        sample.tid = *((const uint32_t *) (body + 12));
+        sample.time = *((const uint64_t *) (body + 16));
+        sample.addr = *((const uint64_t *) (body + 24));
+        if (sample.addr != 0) {
+            sampler.samples.push_back(sample);
+        }
+    }
+
+    __sync_synchronize();
+    meta->data_tail = tail;
+}
+
+static void drain_rings() {
+    for (unsigned int i = 0; i < sampler.rings.size(); i++) {
+        drain_ring(sampler.rings[i]);
+    }
+}
+
+static void run_sampled(char **argv, uint64_t event, uint64_t period) {
+    sampler.exe = find_exe(argv[0]);
+    read_segments();
+    sampler.exe_base = 0;
+    sampler.found_base = sampler.segments.empty();
+
+    int go[2];
+    if (pipe(go) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+
+    sampler.child = fork();
+    if (sampler.child == 0) {
+        // wait until the counter is attached, enable_on_exec starts it
+        char c;
+        close(go[1]);
+        if (read(go[0], &c, 1) != 1) {
+            _exit(1);
+        }
+        execv(sampler.exe.c_str(), argv);
+        perror("execv");
+        _exit(127);
+    }
+    close(go[0]);
+
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_RAW;
+    attr.config = event;
+    attr.sample_period = period;
+    attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_ADDR;
+    attr.precise_ip = 2;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.mmap = 1;
+    attr.mmap2 = 1;
+    attr.wakeup_events = 64;
+
+    const uint64_t page_size = sysconf(_SC_PAGESIZE);
+    sampler.ring_size = RING_PAGES * page_size;
+    const long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    for (long cpu = 0; cpu < cpus; cpu++) {
+        int fd = perf_event_open(&attr, sampler.child, cpu, -1, 0);
+        if (fd < 0 && errno == ENODEV) {
+            continue; // offline
+        }
+        if (fd < 0) {
+            fprintf(stderr, "perf_event_open failed (%s), check the event and perf_event_paranoid\n",
+                    strerror(errno));
+            kill(sampler.child, SIGKILL);
+            exit(1);
+        }
+
+        struct perf_event_mmap_page *ring = (struct perf_event_mmap_page *) mmap(
+            NULL, sampler.ring_size + page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (ring == MAP_FAILED) {
+            perror("mmap");
+            kill(sampler.child, SIGKILL);
+            exit(1);
+        }
+        sampler.fds.push_back(fd);
+        sampler.rings.push_back(ring);
+    }
+    if (sampler.fds.empty()) {
+        fprintf(stderr, "No cpu to sample on\n");
+        kill(sampler.child, SIGKILL);
+        exit(1);
+    }
+
+    if (write(go[1], "g", 1) != 1) {
+        perror("write");
+        exit(1);
+    }
+    close(go[1]);
+
+    vector<struct pollfd> pfds(sampler.fds.size());
+    for (unsigned int i = 0; i < sampler.fds.size(); i++) {
+        pfds[i].fd = sampler.fds[i];
+        pfds[i].events = POLLIN;
+    }
+
+    int status;
+    while (true) {
+        poll(&pfds[0], pfds.size(), 100);
+        drain_rings();
+
+        if (waitpid(sampler.child, &status, WNOHANG) == sampler.child) {
+            break;
+        }
+    }
+    drain_rings();
+
+    // the rings are per cpu and threads move between them
+    stable_sort(sampler.samples.begin(), sampler.samples.end(), sample_before);
+
+    if (!sampler.found_base) {
+        fprintf(stderr, "No mapping of %s was seen, cannot place its samples\n", sampler.exe.c_str());
+        exit(1);
+    }
+}
+
+/***** attribution *****/
+
+// Maps every sampled ip to a load id with addr2line, ips of lines holding
+// more than one load are left out.
+static void resolve_ips(map<uint64_t, uint32_t> &ip_to_load) {
+    set<uint64_t> ips;
+    for (unsigned int i = 0; i < sampler.samples.size(); i++) {
+        ips.insert(sampler.samples[i].ip);
+    }
+    vector<uint64_t> ip_list(ips.begin(), ips.end());
+
+    char ip_file[] = "/tmp/stride-sampler.XXXXXX";
+    int ip_fd = mkstemp(ip_file);
+    if (ip_fd < 0) {
+        perror("mkstemp");
+        exit(1);
+    }
+    FILE *ip_out = fdopen(ip_fd, "w");
+    for (unsigned int i = 0; i < ip_list.size(); i++) {
+        fprintf(ip_out, "0x%" PRIx64 "\n", ip_list[i] - sampler.exe_base);
+    }
+    fclose(ip_out);
+
+    // run directly rather than through a shell, the path may hold any character
+    int symbol_pipe[2];
+    if (pipe(symbol_pipe) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+    pid_t addr2line = fork();
+    if (addr2line == 0) {
+        int ip_in = open(ip_file, O_RDONLY);
+        if (ip_in < 0 || dup2(ip_in, 0) < 0 || dup2(symbol_pipe[1], 1) < 0) {
+            _exit(127);
+        }
+        close(ip_in);
+        close(symbol_pipe[0]);
+        close(symbol_pipe[1]);
+        execlp("addr2line", "addr2line", "-f", "-e", sampler.exe.c_str(), (char *) NULL);
+        perror("addr2line");
+        _exit(127);
+    }
+    close(symbol_pipe[1]);
+    FILE *symbols = (addr2line < 0) ? NULL : fdopen(symbol_pipe[0], "r");
+    if (symbols == NULL) {
+        perror("addr2line");
+        exit(1);
+    }
+
+    unsigned int ambiguous = 0, unknown = 0;
+    char function[4096], location[4096];
+    for (unsigned int i = 0; i < ip_list.size(); i++) {
+        if (fgets(function, sizeof(function), symbols) == NULL ||
+            fgets(location, sizeof(location), symbols) == NULL) {
+            break;
+        }
+        function[strcspn(function, "\n")] = '\0';
+
+        // file:line or file:line (discriminator n)
+        char *colon = strrchr(location, ':');
+        unsigned int line;
+        if (colon == NULL || sscanf(colon + 1, "%u", &line) != 1) {
+            unknown++;
+            continue;
+        }
+
+        map< pair<string, unsigned int>, vector<site_t> >::iterator site =
+            Sites.find(make_pair(string(function), line));
+        if (site == Sites.end()) {
+            unknown++;
+        } else if (site->second.size() > 1) {
+            ambiguous++;
+        } else {
+            ip_to_load[ip_list[i]] = site->second[0].load_id;
+        }
+    }
+    fclose(symbols);
+    waitpid(addr2line, NULL, 0);
+    unlink(ip_file);
+
+    cerr << ip_list.size() << " sampled load ips: " << ip_to_load.size() << " attributed, "
+         << ambiguous << " on lines with several loads, " << unknown << " without a site" << endl;
+}
+
+static long gcd(long a, long b) {
+    while (b != 0) {
+        long t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Consecutive samples of a load are about period executions apart, so the
+// deltas of a strided load are multiples of its stride. The gcd of the
+// deltas is taken as the stride when the implied number of executions per
+// delta is near the period; otherwise the deltas are recorded as they are.
+// exec_count covers the traces of the load in all threads.
+static void add_trace(uint32_t load_id, const vector<uint64_t> &addrs, uint64_t period,
+                      int32_t exec_count) {
+    vector<long> deltas;
+    long stride = 0;
+    for (unsigned int i = 1; i < addrs.size(); i++) {
+        long delta = (long) (addrs[i] - addrs[i - 1]);
+        deltas.push_back(delta);
+        if (delta != 0) {
+            stride = gcd(stride, labs(delta));
+        }
+    }
+    if (deltas.empty()) {
+        return;
+    }
+
+    if (stride >= MIN_STRIDE) {
+        vector<long> repeats;
+        for (unsigned int i = 0; i < deltas.size(); i++) {
+            if (deltas[i] != 0) {
+                repeats.push_back(labs(deltas[i]) / stride);
+            }
+        }
+        if (!repeats.empty()) {
+            nth_element(repeats.begin(), repeats.begin() + repeats.size() / 2, repeats.end());
+            const long median = repeats[repeats.size() / 2];
+            if (median < (long) period / 4 || median > (long) period * 4) {
+                stride = 0;
+            }
+        }
+    } else {
+        stride = 0;
+    }
+
+    for (unsigned int i = 0; i < deltas.size(); i++) {
+        const long delta = deltas[i];
+        if (delta != 0 && stride != 0) {
+            Stride_StrideProfile_AddStrides(load_id, delta < 0 ? -stride : stride,
+                                            labs(delta) / stride, exec_count);
+        } else {
+            Stride_StrideProfile_AddStrides(load_id, delta, 1, exec_count);
+        }
+    }
+}
+
+static void write_profile(uint64_t period) {
+    map<uint64_t, uint32_t> ip_to_load;
+    resolve_ips(ip_to_load);
+
+    // per load and thread, in sample order
+    map< pair<uint32_t, uint32_t>, vector<uint64_t> > traces;
+    map<uint32_t, uint64_t> load_samples;
+    for (unsigned int i = 0; i < sampler.samples.size(); i++) {
+        const sample_t &sample = sampler.samples[i];
+        map<uint64_t, uint32_t>::iterator load = ip_to_load.find(sample.ip);
+        if (load != ip_to_load.end()) {
+            traces[make_pair(load->second, sample.tid)].push_back(sample.addr);
+            load_samples[load->second]++;
+        }
+    }
+
+    Stride_init();
+    for (unsigned int i = 0; i < Checksums.size(); i++) {
+        Stride_RecordChecksum(Checksums[i].first, Checksums[i].second);
+    }
+    for (map< pair<uint32_t, uint32_t>, vector<uint64_t> >::iterator trace = traces.begin();
+         trace != traces.end(); trace++) {
+        const uint32_t load_id = trace->first.first;
+        const int32_t exec_count = (int32_t) min<uint64_t>(load_samples[load_id] * period, INT32_MAX);
+        add_trace(load_id, trace->second, period, exec_count);
+    }
+    // Stride_finish writes result.stride.profile at exit
+}
+
+int main(int argc, char **argv) {
+    uint64_t period = DEFAULT_PERIOD;
+    uint64_t event = DEFAULT_EVENT;
+    const char *sites = "result.stride.sites";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "+p:e:s:")) != -1) {
+        switch (opt) {
+        case 'p':
+            period = strtoull(optarg, NULL, 0);
+            break;
+        case 'e':
+            event = strtoull(optarg, NULL, 0);
+            break;
+        case 's':
+            sites = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind >= argc || period == 0) {
+        usage();
+    }
+
+    read_sites(sites);
+    run_sampled(argv + optind, event, period);
+    cerr << sampler.samples.size() << " load samples" << endl;
+    write_profile(period);
+    return 0;
+}
@@ -0,0 +1,319 @@
+#ifndef INTERVAL_MAP_H
+#define INTERVAL_MAP_H
+
+#include <map>
+#include "MemoryMap.hxx"
+
+namespace Memory {
+
+    enum shadow_state_t {SHADOW_UNKNOWN = 0, SHADOW_VALID = 1, SHADOW_INVALID = 2};
+
+    // Validity of an address range kept as non-overlapping [start, end)
+    // intervals of one state each. Bytes outside every interval are
+    // unknown. A write only splits the intervals at its two ends and
+    // neighbours with the same state are joined again, so a buffer filled
+    // by sequential reads stays a single interval.
+    class IntervalMap {
+    private:
+        struct Interval {
+            uint64_t end;
+            shadow_state_t state;
+        };
+
+        typedef map<uint64_t, Interval> IntervalList;
+
+        IntervalList intervals;
+
+        IntervalMap(const IntervalMap &map) {}
+
+        IntervalMap &operator=(const IntervalMap &map) {return *this;}
+
+        // Makes addr the start of an interval if one covers it
+        void split(uint64_t addr) {
+            IntervalList::iterator iter = this->intervals.upper_bound(addr);
+            if (iter == this->intervals.begin())
+                return;
+            iter--;
+            if (iter->first < addr && addr < iter->second.end) {
+                Interval tail = iter->second;
+                iter->second.end = addr;
+                this->intervals[addr] = tail;
+            }
+        }
+
+        // Joins the interval starting at addr with the ones around it
+        void join(uint64_t addr) {
+            IntervalList::iterator iter = this->intervals.find(addr);
+            if (iter == this->intervals.end())
+                return;
+
+            IntervalList::iterator next = iter;
+            next++;
+            while (next != this->intervals.end() && next->first == iter->second.end
+                   && next->second.state == iter->second.state) {
+                iter->second.end = next->second.end;
+                this->intervals.erase(next++);
+            }
+
+            if (iter != this->intervals.begin()) {
+                IntervalList::iterator prev = iter;
+                prev--;
+                if (prev->second.end == iter->first && prev->second.state == iter->second.state) {
+                    prev->second.end = iter->second.end;
+                    this->intervals.erase(iter);
+                }
+            }
+        }
+
+        void insert(uint64_t start, uint64_t end, shadow_state_t state) {
+            if (state == SHADOW_UNKNOWN || start >= end)
+                return;
+            Interval interval = {end, state};
+            this->intervals[start] = interval;
+        }
+
+        // Replaces the state of every byte of [start, end), gaps included,
+        // with transform(state)
+        template <class Transform>
+        void apply(uint64_t start, uint64_t end, Transform transform) {
+            if (start >= end)
+                return;
+
+            split(start);
+            split(end);
+
+            vector<pair<uint64_t, Interval> > pieces;
+            uint64_t current = start;
+            IntervalList::iterator iter = this->intervals.lower_bound(start);
+            while (iter != this->intervals.end() && iter->first < end) {
+                if (current < iter->first) {
+                    Interval gap = {iter->first, transform(SHADOW_UNKNOWN)};
+                    pieces.push_back(make_pair(current, gap));
+                }
+                Interval piece = {iter->second.end, transform(iter->second.state)};
+                pieces.push_back(make_pair(iter->first, piece));
+                current = iter->second.end;
+                this->intervals.erase(iter++);
+            }
+            if (current < end) {
+                Interval gap = {end, transform(SHADOW_UNKNOWN)};
+                pieces.push_back(make_pair(current, gap));
+            }
+
+            for (size_t i = 0; i < pieces.size(); i++) {
+                insert(pieces[i].first, pieces[i].second.end, pieces[i].second.state);
+            }
+            for (size_t i = 0; i < pieces.size(); i++) {
+                join(pieces[i].first);
+            }
+        }
+
+        struct Assign {
+            shadow_state_t state;
+            shadow_state_t operator()(shadow_state_t old) const {return state;}
+        };
+
+        // Same as MemoryPage::set_invalid: valid becomes unknown
+        struct Invalidate {
+            shadow_state_t operator()(shadow_state_t old) const {
+                return (old == SHADOW_VALID) ? SHADOW_UNKNOWN : SHADOW_INVALID;
+            }
+        };
+
+    public:
+        IntervalMap() : intervals() {}
+
+        size_t size() const {
+            return this->intervals.size();
+        }
+
+        void set_range_valid(uint64_t addr, uint64_t n) {
+            Assign valid = {SHADOW_VALID};
+            apply(addr, addr + n, valid);
+        }
+
+        void set_range_invalid(uint64_t addr, uint64_t n) {
+            apply(addr, addr + n, Invalidate());
+        }
+
+        void clear_range(uint64_t addr, uint64_t n) {
+            Assign unknown = {SHADOW_UNKNOWN};
+            apply(addr, addr + n, unknown);
+        }
+
+        // ALL when every byte of [addr, addr + n) is in a valid interval
+        valid_t num_valid(uint64_t addr, uint64_t n) const {
+            const uint64_t end = addr + n;
+            uint64_t covered = 0;
+            IntervalList::const_iterator iter = this->intervals.upper_bound(addr);
+            if (iter != this->intervals.begin())
+                iter--;
+            for (; iter != this->intervals.end() && iter->first < end; iter++) {
+                if (iter->second.state != SHADOW_VALID || iter->second.end <= addr)
+                    continue;
+                const uint64_t first = (iter->first > addr) ? iter->first : addr;
+                const uint64_t last = (iter->second.end < end) ? iter->second.end : end;
+                covered += last - first;
+            }
+            if (covered == 0)
+                return NONE;
+            return (covered == n) ? ALL : SOME;
+        }
+
+        bool is_range_valid(uint64_t addr, uint64_t n) const {
+            return num_valid(addr, n) == ALL;
+        }
+
+        // True when every byte of [addr, addr + n) is in an invalid interval
+        bool is_range_invalid(uint64_t addr, uint64_t n) const {
+            IntervalList::const_iterator iter = this->intervals.upper_bound(addr);
+            if (iter == this->intervals.begin())
+                return false;
+            iter--;
+            return iter->second.state == SHADOW_INVALID && iter->second.end >= addr + n;
+        }
+    };
+
+    // Validity shadow that keeps allocations of at least intervalThreshold
+    // bytes in an IntervalMap and everything else in MemoryPages. Streaming
+    // reads into a large buffer then cost one interval rather than one page
+    // of shadow per 4K.
+    template <unsigned int PAGE_BITS = DEFAULT_PAGE_BITS>
+    class RegionValidityMap {
+    private:
+        typedef map<uint64_t, uint64_t> RegionList;
+
+        const uint64_t intervalThreshold;
+
+        RegionList largeRegions;     // start -> end of interval tracked allocations
+
+        IntervalMap intervals;
+
+        MemoryNodeMap<uint8_t, PAGE_BITS> pages;
+
+        RegionValidityMap(const RegionValidityMap &map) : intervalThreshold(0) {}
+
+        RegionValidityMap &operator=(const RegionValidityMap &map) {return *this;}
+
+        // Bytes of [addr, end) up to the next region boundary; large is set
+        // if they lie in an interval tracked allocation
+        uint64_t region_span(uint64_t addr, uint64_t end, bool &large) const {
+            RegionList::const_iterator next = this->largeRegions.upper_bound(addr);
+            if (next != this->largeRegions.begin()) {
+                RegionList::const_iterator region = next;
+                region--;
+                if (addr < region->second) {
+                    large = true;
+                    return ((region->second < end) ? region->second : end) - addr;
+                }
+            }
+            large = false;
+            if (next != this->largeRegions.end() && next->first < end)
+                return next->first - addr;
+            return end - addr;
+        }
+
+    public:
+        RegionValidityMap(uint64_t interval_threshold = 1ULL << 16)
+            : intervalThreshold(interval_threshold), largeRegions(), intervals(), pages() {}
+
+        // Called for every allocation; only large ones are tracked as intervals
+        void allocate(const void *addr, uint64_t n) {
+            if (n < this->intervalThreshold)
+                return;
+            const uint64_t start = (uint64_t) (intptr_t) addr;
+            this->pages.clear_range(addr, n);
+            this->largeRegions[start] = start + n;
+        }
+
+        void deallocate(const void *addr) {
+            RegionList::iterator region = this->largeRegions.find((uint64_t) (intptr_t) addr);
+            if (region == this->largeRegions.end())
+                return;
+            this->intervals.clear_range(region->first, region->second - region->first);
+            this->largeRegions.erase(region);
+        }
+
+        void set_range_valid(const void *addr, uint64_t n) {
+            uint64_t current = (uint64_t) (intptr_t) addr;
+            const uint64_t end = current + n;
+            while (current < end) {
+                bool large;
+                const uint64_t span = region_span(current, end, large);
+                if (large)
+                    this->intervals.set_range_valid(current, span);
+                else
+                    this->pages.set_range_valid((const void *) (intptr_t) current, span);
+                current += span;
+            }
+        }
+
+        void set_range_invalid(const void *addr, uint64_t n) {
+            uint64_t current = (uint64_t) (intptr_t) addr;
+            const uint64_t end = current + n;
+            while (current < end) {
+                bool large;
+                const uint64_t span = region_span(current, end, large);
+                if (large)
+                    this->intervals.set_range_invalid(current, span);
+                else
+                    this->pages.set_range_invalid((const void *) (intptr_t) current, span);
+                current += span;
+            }
+        }
+
+        void clear_range(const void *addr, uint64_t n) {
+            uint64_t current = (uint64_t) (intptr_t) addr;
+            const uint64_t end = current + n;
+            while (current < end) {
+                bool large;
+                const uint64_t span = region_span(current, end, large);
+                if (large)
+                    this->intervals.clear_range(current, span);
+                else
+                    this->pages.clear_range((const void *) (intptr_t) current, span);
+                current += span;
+            }
+        }
+
+        bool is_range_valid(const void *addr, uint64_t n) const {
+            uint64_t current = (uint64_t) (intptr_t) addr;
+            const uint64_t end = current + n;
+            while (current < end) {
+                bool large;
+                const uint64_t span = region_span(current, end, large);
+                const bool valid = large ? this->intervals.is_range_valid(current, span)
+                    : this->pages.is_range_valid((const void *) (intptr_t) current, span);
+                if (!valid)
+                    return false;
+                current += span;
+            }
+            return true;
+        }
+
+        template <class S>
+        bool is_valid(const void *addr) const {
+            return is_range_valid(addr, sizeof(S));
+        }
+
+        template <class S>
+        void set_valid(const void *addr) {
+            set_range_valid(addr, sizeof(S));
+        }
+
+        template <class S>
+        void set_invalid(const void *addr) {
+            set_range_invalid(addr, sizeof(S));
+        }
+
+        size_t num_intervals() const {
+            return this->intervals.size();
+        }
+
+        size_t num_pages() const {
+            return this->pages.num_pages();
+        }
+    };
+}
+
+#endif
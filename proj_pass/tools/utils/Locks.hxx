@@ -1,5 +1,12 @@
+#ifndef LOCKS_H
+#define LOCKS_H
+
 #include <pthread.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
 
 namespace Locks {
     class Mutex {
@@ -104,4 +111,294 @@ namespace Locks {
             }
         }
     };
+
+    /*
+     * Lock-free building blocks for the profiling runtimes. They use the
+     * GCC __atomic builtins directly, like the stride runtime's sampling
+     * rings, and spin instead of sleeping.
+     */
+
+    static const size_t CACHE_LINE_SIZE = 64;
+
+    // Indexes handed out by threadIndex. Allocated once and never freed, so
+    // that threads exiting after the static destructors still find it.
+    struct ThreadIndexes {
+        pthread_mutex_t lock;
+        pthread_key_t key;      // its destructor returns an exiting thread's index
+        uint32_t next;
+        std::vector<uint32_t> free;
+
+        ThreadIndexes();
+    };
+
+    inline uint32_t &ownThreadIndex() {
+        static __thread uint32_t index = ~0U;
+        return index;
+    }
+
+    inline void releaseThreadIndex(void *value);
+
+    inline ThreadIndexes::ThreadIndexes() : next(0), free() {
+        pthread_mutex_init(&this->lock, NULL);
+        if (pthread_key_create(&this->key, releaseThreadIndex) != 0) {
+            fprintf(stderr, "Unable to create thread index key\n");
+            abort();
+        }
+    }
+
+    inline ThreadIndexes &threadIndexes() {
+        static ThreadIndexes *indexes = new ThreadIndexes();
+        return *indexes;
+    }
+
+    inline void releaseThreadIndex(void *value) {
+        ThreadIndexes &indexes = threadIndexes();
+        pthread_mutex_lock(&indexes.lock);
+        indexes.free.push_back((uint32_t) ((uintptr_t) value - 1));
+        pthread_mutex_unlock(&indexes.lock);
+        ownThreadIndex() = ~0U;
+    }
+
+    // Small dense index of the calling thread, assigned on its first call.
+    // The index of an exited thread goes to the next new thread, so indexes
+    // stay below the largest number of threads alive at once and per-thread
+    // slots indexed by them keep what the exited thread left in them.
+    inline uint32_t threadIndex() {
+        uint32_t &index = ownThreadIndex();
+        if (__builtin_expect(index == ~0U, 0)) {
+            ThreadIndexes &indexes = threadIndexes();
+            pthread_mutex_lock(&indexes.lock);
+            if (indexes.free.empty()) {
+                index = indexes.next++;
+            } else {
+                index = indexes.free.back();
+                indexes.free.pop_back();
+            }
+            pthread_mutex_unlock(&indexes.lock);
+            pthread_setspecific(indexes.key, (void *) ((uintptr_t) index + 1));
+        }
+        return index;
+    }
+
+    inline void cpuRelax() {
+#if defined(__i386__) || defined(__x86_64__)
+        __builtin_ia32_pause();
+#endif
+    }
+
+    // Bounded queue between exactly one producer and one consumer thread.
+    // SIZE must be a power of two; push fails rather than blocks when full.
+    template <class T, uint32_t SIZE>
+    class SPSCRing {
+    private:
+        SPSCRing(const SPSCRing &ring) {}
+
+        SPSCRing &operator=(const SPSCRing &ring) {return *this;}
+
+        static const uint32_t MASK = SIZE - 1;
+
+        // head is written by the consumer only, tail by the producer only
+        uint64_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+        uint64_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+
+        T items[SIZE] __attribute__((aligned(CACHE_LINE_SIZE)));
+
+    public:
+        SPSCRing() : head(0), tail(0) {
+            if ((SIZE & MASK) != 0) {
+                fprintf(stderr, "SPSCRing size %u is not a power of two\n", SIZE);
+                abort();
+            }
+        }
+
+        bool push(const T &item) {
+            const uint64_t t = this->tail;
+            if (t - __atomic_load_n(&this->head, __ATOMIC_ACQUIRE) == SIZE) {
+                return false;
+            }
+            this->items[t & MASK] = item;
+            __atomic_store_n(&this->tail, t + 1, __ATOMIC_RELEASE);
+            return true;
+        }
+
+        bool pop(T &item) {
+            const uint64_t h = this->head;
+            if (h == __atomic_load_n(&this->tail, __ATOMIC_ACQUIRE)) {
+                return false;
+            }
+            item = this->items[h & MASK];
+            __atomic_store_n(&this->head, h + 1, __ATOMIC_RELEASE);
+            return true;
+        }
+
+        // Exact for the producer and the consumer, a hint for anyone else
+        uint64_t size() const {
+            return __atomic_load_n(&this->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&this->head, __ATOMIC_ACQUIRE);
+        }
+    };
+
+    // Counter with one cache line per thread. add() is a plain increment of
+    // the caller's own slot; read() sums the slots with relaxed loads, so it
+    // may miss increments that are in flight but never tears a slot.
+    template <uint32_t MAX_THREADS = 64>
+    class PerThreadCounter {
+    private:
+        PerThreadCounter(const PerThreadCounter &counter) {}
+
+        PerThreadCounter &operator=(const PerThreadCounter &counter) {return *this;}
+
+        struct Slot {
+            uint64_t value;
+        } __attribute__((aligned(CACHE_LINE_SIZE)));
+
+        Slot slots[MAX_THREADS];
+
+    public:
+        PerThreadCounter() {
+            memset(this->slots, 0, sizeof(this->slots));
+        }
+
+        void add(uint64_t n) {
+            const uint32_t index = threadIndex();
+            if (index >= MAX_THREADS) {
+                fprintf(stderr, "PerThreadCounter supports %u threads, thread %u counted\n", MAX_THREADS, index);
+                abort();
+            }
+            uint64_t *value = &this->slots[index].value;
+            __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+        }
+
+        uint64_t read() const {
+            uint64_t sum = 0;
+            for (uint32_t i = 0; i < MAX_THREADS; i++) {
+                sum += __atomic_load_n(&this->slots[i].value, __ATOMIC_RELAXED);
+            }
+            return sum;
+        }
+    };
+
+    // Read-copy-update for structures such as page tables that are read on
+    // every event and replaced rarely. Readers bracket their accesses with
+    // readLock/readUnlock, which only touch the reader's own cache line. A
+    // writer publishes a new version, then synchronize() waits until every
+    // reader that might still see the old one has left, after which the old
+    // version can be freed. Writers must be serialized by the caller.
+    template <uint32_t MAX_THREADS = 64>
+    class RCU {
+    private:
+        RCU(const RCU &rcu) {}
+
+        RCU &operator=(const RCU &rcu) {return *this;}
+
+        // Odd while the thread is inside a read section
+        struct Slot {
+            uint64_t sequence;
+        } __attribute__((aligned(CACHE_LINE_SIZE)));
+
+        Slot slots[MAX_THREADS];
+
+        uint64_t *own() {
+            const uint32_t index = threadIndex();
+            if (index >= MAX_THREADS) {
+                fprintf(stderr, "RCU supports %u threads, thread %u reading\n", MAX_THREADS, index);
+                abort();
+            }
+            return &this->slots[index].sequence;
+        }
+
+    public:
+        RCU() {
+            memset(this->slots, 0, sizeof(this->slots));
+        }
+
+        // Not reentrant
+        void readLock() {
+            uint64_t *sequence = own();
+            __atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        }
+
+        void readUnlock() {
+            uint64_t *sequence = own();
+            __atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELEASE);
+        }
+
+        void synchronize() {
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            for (uint32_t i = 0; i < MAX_THREADS; i++) {
+                const uint64_t seen = __atomic_load_n(&this->slots[i].sequence, __ATOMIC_ACQUIRE);
+                if ((seen & 1) == 0) {
+                    continue;
+                }
+                while (__atomic_load_n(&this->slots[i].sequence, __ATOMIC_ACQUIRE) == seen) {
+                    cpuRelax();
+                }
+            }
+        }
+    };
+
+    // Pointer published under an RCU; see RCU for the protocol
+    template <class T>
+    class RCUPointer {
+    private:
+        RCUPointer(const RCUPointer &pointer) {}
+
+        RCUPointer &operator=(const RCUPointer &pointer) {return *this;}
+
+        T *current;
+
+    public:
+        RCUPointer(T *initial = NULL) : current(initial) {}
+
+        // Only between RCU::readLock and readUnlock
+        T *read() const {
+            return __atomic_load_n(&this->current, __ATOMIC_ACQUIRE);
+        }
+
+        // Returns the old version, which may be freed after RCU::synchronize
+        T *publish(T *version) {
+            return __atomic_exchange_n(&this->current, version, __ATOMIC_ACQ_REL);
+        }
+    };
+
+    // Sequence lock for taking consistent snapshots of data that one writer
+    // updates often: readers never block the writer, they retry instead.
+    //
+    //   do { s = lock.readBegin(); copy = data; } while (lock.readRetry(s));
+    class SeqLock {
+    private:
+        SeqLock(const SeqLock &lock) {}
+
+        SeqLock &operator=(const SeqLock &lock) {return *this;}
+
+        uint64_t sequence;
+
+    public:
+        SeqLock() : sequence(0) {}
+
+        // Writers must be serialized by the caller
+        void writeBegin() {
+            __atomic_store_n(&this->sequence, this->sequence + 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+        }
+
+        void writeEnd() {
+            __atomic_store_n(&this->sequence, this->sequence + 1, __ATOMIC_RELEASE);
+        }
+
+        uint64_t readBegin() const {
+            uint64_t s;
+            while (((s = __atomic_load_n(&this->sequence, __ATOMIC_ACQUIRE)) & 1) != 0) {
+                cpuRelax();
+            }
+            return s;
+        }
+
+        bool readRetry(uint64_t s) const {
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            return __atomic_load_n(&this->sequence, __ATOMIC_RELAXED) != s;
+        }
+    };
 }
+
+#endif
@@ -7,31 +7,54 @@
 #include <stdlib.h>
 #include <iterator>
 #include <cassert>
+#include <vector>
 
-#include "CircularQueue.hxx"
+#include "Profile.hxx"
 
 using namespace std;
-using namespace Collections;
 
 namespace Loop {
 
     static const uint64_t DEFAULT_DEPENDENCE_DISTANCE = 5;
 
+    // Smallest power of two that is at least N
+    template <uint64_t N, uint64_t P = 1, bool DONE = (P >= N)>
+    struct PowerOfTwoAtLeast {
+	static const uint64_t value = PowerOfTwoAtLeast<N, P * 2>::value;
+    };
+
+    template <uint64_t N, uint64_t P>
+    struct PowerOfTwoAtLeast<N, P, true> {
+	static const uint64_t value = P;
+    };
+
     template<class T, int maxDepDist = DEFAULT_DEPENDENCE_DISTANCE>
     class LoopInfo {
     public:
-	circular_buffer<uint64_t> iteration_time_stamps;
+	static const uint64_t RING_SIZE = PowerOfTwoAtLeast<maxDepDist>::value;
+
+	static const uint64_t RING_MASK = RING_SIZE - 1;
+
+	// The time stamps of the last maxDepDist iterations, inline so that
+	// entering and iterating a loop never allocates. Iteration i is in
+	// slot i & RING_MASK.
+	uint64_t iteration_time_stamps[RING_SIZE];
+	uint64_t iterations;
 	uint64_t invocation_time_stamp;
-	uint16_t loop_id;
+	uint32_t loop_id;
 	T item;
 
-	LoopInfo() : iteration_time_stamps(maxDepDist), invocation_time_stamp(0), loop_id(0), item() { 
+	LoopInfo() : iterations(0), invocation_time_stamp(0), loop_id(0), item() { 
 	}
 
 	void reset(uint64_t loop, uint64_t time_stamp) {
+	    if (loop > Profiling::PROFILE_LOOP_MAX) {
+		cerr<<"Loop id "<<loop<<" above "<<Profiling::PROFILE_LOOP_MAX<<endl;
+		abort();
+	    }
 	    this->loop_id = loop;
 	    this->invocation_time_stamp = time_stamp;
-	    this->iteration_time_stamps.clear();
+	    this->iterations = 0;
 	}
 
 	T & getItem() {
@@ -43,7 +66,17 @@ namespace Loop {
 	}
 
 	void iteration(uint64_t time_stamp) {
-	    this->iteration_time_stamps.push_back(time_stamp);
+	    this->iteration_time_stamps[this->iterations & RING_MASK] = time_stamp;
+	    this->iterations++;
+	}
+
+	// Time stamp of the iteration age iterations before the latest one
+	uint64_t recentIteration(uint64_t age) const {
+	    return this->iteration_time_stamps[(this->iterations - 1 - age) & RING_MASK];
+	}
+
+	uint64_t numRecentIterations() const {
+	    return (this->iterations < (uint64_t) maxDepDist) ? this->iterations : maxDepDist;
 	}
     };
 
@@ -72,7 +105,8 @@ namespace Loop {
 	
 	void enterLoop(uint64_t loop_id, uint64_t timestamp) {
 	    this->current_depth++;
-	    this->loop_info.at(this->current_depth).reset(loop_id, timestamp);
+	    checkDepth();
+	    this->loop_info[this->current_depth].reset(loop_id, timestamp);
 
 	    if (this->current_depth > this->max_depth) {
 		this->max_depth = this->current_depth;
@@ -90,14 +124,17 @@ namespace Loop {
 	    this->getCurrentLoop().iteration(time_stamp);
 	}
 
+	// current_depth wraps around to a huge value when exiting the outermost loop
+	void checkDepth() const {
+	    if (__builtin_expect(this->current_depth >= (uint32_t) maxLoopDepth, 0)) {
+		cerr<<"Current Loop Depth: "<<(int32_t) this->current_depth<<" outside [0, "<<maxLoopDepth<<")"<<endl;
+		abort();
+	    }
+	}
+
 	LoopInfoType & getCurrentLoop() {
-		try {                                                    // -PC , 2/5/2009 add catch exception
-	    this->loop_info.at(this->current_depth);
-		}catch (std::out_of_range outOfRange){
-			cout << "\n\nException: " << outOfRange.what();
-			cout << "\nCurrent Loop Depth: " << current_depth;
-		}
-    return this->loop_info.at(this->current_depth);
+	    checkDepth();
+	    return this->loop_info[this->current_depth];
 	}
 
 	LoopInfoType & findLoop(uint64_t store_time_stamp) {
@@ -119,13 +156,12 @@ namespace Loop {
 	}
 
 	uint32_t calculateDistance(LoopInfoType &store_loop, uint64_t store_time_stamp) {
-	    circular_buffer<uint64_t>::reverse_iterator iter = store_loop.iteration_time_stamps.rbegin();
+	    const uint64_t recent = store_loop.numRecentIterations();
 
 	    uint32_t distance = 0;
-	    for (; iter != store_loop.iteration_time_stamps.rend(); iter++) {
-		if (*iter <= store_time_stamp)
+	    for (; distance < recent; distance++) {
+		if (store_loop.recentIteration(distance) <= store_time_stamp)
 		    break;
-		distance++;
 	    }
 
 	    return distance;
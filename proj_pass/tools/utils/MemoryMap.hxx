@@ -9,11 +9,21 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include <string.h>
+#include <sys/mman.h>
 #include "utils.hxx"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include <iostream>
 using namespace std;
 
+#include <vector>
+#include <new>
+
 #include <ext/hash_map>
 using namespace __gnu_cxx;
 
@@ -104,6 +114,54 @@ namespace Memory {
 
     enum valid_t {NONE = 0, SOME = 1, ALL = 2};
 
+    // Spreads the 8 bits of bits to the 8 bytes of the result, 0xff for a
+    // set bit, so a validity bitmap can select bytes of a value word.
+    static inline uint64_t expand_byte_mask(uint64_t bits) {
+        bits = (bits | (bits << 28)) & 0x0000000F0000000FULL;
+        bits = (bits | (bits << 14)) & 0x0003000300030003ULL;
+        bits = (bits | (bits << 7)) & 0x0101010101010101ULL;
+        return bits * 0xFF;
+    }
+
+    // dst[i] = src[i] for every set bit i of bits
+    static inline void blend_bytes(uint8_t *dst, const uint8_t *src, uint64_t bits) {
+#if defined(__AVX2__)
+        const __m256i select = _mm256_set1_epi64x(0x8040201008040201ULL);
+        const __m256i spread = _mm256_setr_epi64x(0x0000000000000000ULL, 0x0101010101010101ULL,
+                                                  0x0202020202020202ULL, 0x0303030303030303ULL);
+        for (int half = 0; half < 2; half++, bits >>= 32) {
+            __m256i mask = _mm256_shuffle_epi8(_mm256_set1_epi32((uint32_t) bits), spread);
+            mask = _mm256_cmpeq_epi8(_mm256_and_si256(mask, select), select);
+            const __m256i from = _mm256_loadu_si256((const __m256i *) (src + half * 32));
+            const __m256i to = _mm256_loadu_si256((const __m256i *) (dst + half * 32));
+            _mm256_storeu_si256((__m256i *) (dst + half * 32), _mm256_blendv_epi8(to, from, mask));
+        }
+#elif defined(__SSE2__)
+        for (int quarter = 0; quarter < 4; quarter++, bits >>= 16) {
+            const __m128i mask = _mm_set_epi64x(expand_byte_mask((bits >> 8) & 0xFF), expand_byte_mask(bits & 0xFF));
+            const __m128i from = _mm_loadu_si128((const __m128i *) (src + quarter * 16));
+            const __m128i to = _mm_loadu_si128((const __m128i *) (dst + quarter * 16));
+            _mm_storeu_si128((__m128i *) (dst + quarter * 16),
+                             _mm_or_si128(_mm_and_si128(mask, from), _mm_andnot_si128(mask, to)));
+        }
+#else
+        for (int i = 0; i < 8; i++, bits >>= 8) {
+            const uint64_t mask = expand_byte_mask(bits & 0xFF);
+            uint64_t from, to;
+            memcpy(&from, src + i * 8, sizeof(from));
+            memcpy(&to, dst + i * 8, sizeof(to));
+            to = (from & mask) | (to & ~mask);
+            memcpy(dst + i * 8, &to, sizeof(to));
+        }
+#endif
+    }
+
+    // HEAP_PAGES allocates every page with new. SHADOW_REGIONS reserves one
+    // MAP_NORESERVE region of page slots per 16MB of address space (for 4K
+    // pages) on first use and finds a page by its offset; the kernel
+    // supplies zeroed memory only for the slots that are touched.
+    enum backing_t {HEAP_PAGES = 0, SHADOW_REGIONS = 1};
+
     static const uint64_t DEFAULT_PAGE_BITS = 12;
 
     // Must be at least 6 to ensure that every bit of a read_track_t is used
@@ -122,12 +180,12 @@ namespace Memory {
 	static const uint64_t ADDR_MASK = ~(OFFSET_MASK);
 	
 	// MJB: The code below assumes that no read can be more bytes than bits in a read_track_t
-	typedef uint8_t read_track_t;
+	typedef uint64_t read_track_t;
 
 	static const uint64_t TRACK_BITS_PER_INDEX = (sizeof(read_track_t) * 8);
 
         // This needs to be consistent with TRACK_BITS_PER_INDEX
-        static const uint64_t TRACK_SHIFT_OFFSET = 3;
+        static const uint64_t TRACK_SHIFT_OFFSET = 6;
 
 	static const uint64_t TRACK_SIZE = PAGE_SIZE / TRACK_BITS_PER_INDEX;
 
@@ -173,11 +231,11 @@ namespace Memory {
 	    return &(this->values[offset]);
 	}
 
-	read_track_t mask(const uint8_t length) const {
-	    return ((1ULL << length) - 1);
+	read_track_t mask(const uint32_t length) const {
+	    return (length >= TRACK_BITS_PER_INDEX) ? ~((read_track_t) 0) : ((1ULL << length) - 1);
 	}
 
-	read_track_t offsetMask(const uint8_t length, const uint32_t offset) const {
+	read_track_t offsetMask(const uint32_t length, const uint32_t offset) const {
             if ((length + offset) > TRACK_BITS_PER_INDEX) {
                 fprintf(stderr, "Can not create offset mask for %u + %u > %" PRIu64 "\n",
                         length, offset, TRACK_BITS_PER_INDEX);
@@ -258,7 +316,77 @@ namespace Memory {
             this->invalid[byte_offset] &= ~mask;
 	}
 
+        // Calls op(index, mask) for every track word of [offset, offset + length)
+        template <class Op>
+        void for_each_track(const uint32_t offset, const uint32_t length, Op &op) {
+            uint32_t current = offset;
+            const uint32_t end = offset + length;
+            while (current < end) {
+                const uint32_t bit_offset = current % TRACK_BITS_PER_INDEX;
+                uint32_t span = TRACK_BITS_PER_INDEX - bit_offset;
+                if (span > end - current) {
+                    span = end - current;
+                }
+                op(current >> TRACK_SHIFT_OFFSET, offsetMask(span, bit_offset));
+                current += span;
+            }
+        }
+
+        struct SetValid {
+            MemoryPage *page;
+            void operator()(uint32_t i, read_track_t m) {
+                page->valid[i] |= m;
+                page->invalid[i] &= ~m;
+            }
+        };
+
+        // Valid bytes become unknown, every other byte becomes invalid
+        struct SetInvalid {
+            MemoryPage *page;
+            void operator()(uint32_t i, read_track_t m) {
+                const read_track_t was_valid = page->valid[i] & m;
+                page->valid[i] &= ~m;
+                page->invalid[i] = (page->invalid[i] | m) & ~was_valid;
+            }
+        };
+
+        struct SetUnknown {
+            MemoryPage *page;
+            void operator()(uint32_t i, read_track_t m) {
+                page->valid[i] &= ~m;
+                page->invalid[i] &= ~m;
+            }
+        };
+
+        struct AnyInvalid {
+            const MemoryPage *page;
+            bool found;
+            void operator()(uint32_t i, read_track_t m) {
+                found = found || ((page->invalid[i] & m) != 0);
+            }
+        };
+
+        bool is_offset_range_valid(const uint32_t offset, const uint32_t length) const {
+            uint32_t current = offset;
+            const uint32_t end = offset + length;
+            while (current < end) {
+                const uint32_t bit_offset = current % TRACK_BITS_PER_INDEX;
+                uint32_t span = TRACK_BITS_PER_INDEX - bit_offset;
+                if (span > end - current) {
+                    span = end - current;
+                }
+                const read_track_t m = offsetMask(span, bit_offset);
+                if ((this->valid[current >> TRACK_SHIFT_OFFSET] & m) != m) {
+                    return false;
+                }
+                current += span;
+            }
+            return true;
+        }
+
     public:
+        static const unsigned int BITS = PAGE_BITS;
+
         MemoryPage(pageaddr_t addr) : page_addr(addr) {
             if (am_page_addr((void *) addr) != (uint64_t) addr) {
 		cerr<<"Invalid key address"<<endl;
@@ -292,7 +420,7 @@ namespace Memory {
 
 	void clear() {
 	    memset(this->valid, 0, sizeof(this->valid));
-            memst(this->invalid, 0, sizeof(this->invalid));
+            memset(this->invalid, 0, sizeof(this->invalid));
 	}
 
 	const T *getItem(const void * addr) const {
@@ -339,17 +467,32 @@ namespace Memory {
 	}
 
 	void set_invalid(const void *addr, uint8_t length) {
+	    set_range_invalid(addr, length);
+	}
+
+        // The range versions take any length up to the end of the page
+
+	bool is_range_valid(const void *addr, uint32_t length) const {
 	    check_range(addr, length);
-	    const uint32_t offset = am_offset(addr);
+	    return this->is_offset_range_valid(am_offset(addr), length);
+	}
 
-            for (int i = 0; i < length; i++) {
-                const int coff = offset + i;
-                if (this->is_offset_valid(coff, 1)) {
-                    this->set_offset_unknown(coff, 1);
-                } else {
-                    this->set_offset_invalid(coff, 1);
-                }
-            }
+	void set_range_valid(const void *addr, uint32_t length) {
+	    check_range(addr, length);
+            SetValid op = {this};
+	    this->for_each_track(am_offset(addr), length, op);
+	}
+
+	void set_range_invalid(const void *addr, uint32_t length) {
+	    check_range(addr, length);
+            SetInvalid op = {this};
+	    this->for_each_track(am_offset(addr), length, op);
+	}
+
+	void clear_range(const void *addr, uint32_t length) {
+	    check_range(addr, length);
+            SetUnknown op = {this};
+	    this->for_each_track(am_offset(addr), length, op);
 	}
 
 	const valid_t get_aligned_validity(const void * addr, uint8_t length) const {
@@ -362,41 +505,194 @@ namespace Memory {
     class MemoryMap  {
     private:
 
-	MemoryMap(const MemoryMap<T> &map) {}
+	MemoryMap(const MemoryMap<T> &map) : backing(HEAP_PAGES) {}
 	
 	MemoryMap &operator=(const MemoryMap<T> &map) {return *this;}
 	
     protected:
+        // Pages are found through a three level radix table over the 48 bit
+        // user address space, like a hardware page table. The rare page
+        // above it goes to highPages.
+        static const unsigned int VA_BITS = 48;
+        static const unsigned int PAGE_NUMBER_BITS = VA_BITS - T::BITS;
+        static const unsigned int LEAF_BITS = PAGE_NUMBER_BITS / 3;
+        static const unsigned int MID_BITS = PAGE_NUMBER_BITS / 3;
+        static const unsigned int ROOT_BITS = PAGE_NUMBER_BITS - MID_BITS - LEAF_BITS;
+
+        struct LeafTable {
+            T *pages[1ULL << LEAF_BITS];
+        };
+
+        struct MidTable {
+            LeafTable *leaves[1ULL << MID_BITS];
+        };
+
         typedef hash_map<pageaddr_t, T *, PageAddrHash, PageAddrEquals> PageMap;
 
-        PageMap pageMap;
+        typedef vector<T *> PageList;
+
+        static const uint64_t REGION_PAGES = (1ULL << LEAF_BITS);
+
+        struct RegionTable {
+            char *regions[1ULL << MID_BITS];
+        };
+
+        backing_t backing;
+
+        MidTable *root[1ULL << ROOT_BITS];
+
+        // SHADOW_REGIONS only: REGION_PAGES page slots per leaf
+        RegionTable *regions[1ULL << ROOT_BITS];
+
+        PageMap highPages;
+
+        // every page in creation order, for walking the map
+        PageList pages;
+
+        // the page of the previous lookup, not a page address when empty
+        mutable pageaddr_t lastAddr;
+        mutable T *lastPage;
+
+        T *findPage(const pageaddr_t &addr) const {
+            const uint64_t number = addr >> T::BITS;
+            if ((number >> PAGE_NUMBER_BITS) != 0) {
+                typename PageMap::const_iterator iter = this->highPages.find(addr);
+                return (iter == this->highPages.end()) ? NULL : iter->second;
+            }
+
+            if (this->backing == SHADOW_REGIONS) {
+                const RegionTable *table = this->regions[number >> (MID_BITS + LEAF_BITS)];
+                if (table == NULL) return NULL;
+                const char *region = table->regions[(number >> LEAF_BITS) & ((1ULL << MID_BITS) - 1)];
+                if (region == NULL) return NULL;
+                // an untouched slot reads as zero, so its address never
+                // matches; page 0 is never mapped by a program
+                T *page = (T *) (region + (number & (REGION_PAGES - 1)) * sizeof(T));
+                return (page->getAddress() == addr) ? page : NULL;
+            }
+
+            const MidTable *mid = this->root[number >> (MID_BITS + LEAF_BITS)];
+            if (mid == NULL) return NULL;
+            const LeafTable *leaf = mid->leaves[(number >> LEAF_BITS) & ((1ULL << MID_BITS) - 1)];
+            if (leaf == NULL) return NULL;
+            return leaf->pages[number & ((1ULL << LEAF_BITS) - 1)];
+        }
+
+        T *createPage(const pageaddr_t &addr) {
+            const uint64_t number = addr >> T::BITS;
+            T *page;
+            if (this->backing == SHADOW_REGIONS && (number >> PAGE_NUMBER_BITS) == 0) {
+                RegionTable *&table = this->regions[number >> (MID_BITS + LEAF_BITS)];
+                if (table == NULL) {
+                    table = (RegionTable *) calloc(1, sizeof(RegionTable));
+                }
+                char *&region = table->regions[(number >> LEAF_BITS) & ((1ULL << MID_BITS) - 1)];
+                if (region == NULL) {
+                    void *reserved = mmap(NULL, REGION_PAGES * sizeof(T), PROT_READ | PROT_WRITE,
+                                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+                    if (reserved == MAP_FAILED) {
+                        cerr<<"Could not reserve "<<REGION_PAGES * sizeof(T)<<" bytes of shadow memory"<<endl;
+                        abort();
+                    }
+                    region = (char *) reserved;
+                }
+                page = new (region + (number & (REGION_PAGES - 1)) * sizeof(T)) T(addr);
+            } else {
+                page = new T(addr);
+            }
+            insertPage(addr, page);
+            return page;
+        }
+
+        void insertPage(const pageaddr_t &addr, T *page) {
+            const uint64_t number = addr >> T::BITS;
+            this->pages.push_back(page);
+            if ((number >> PAGE_NUMBER_BITS) != 0) {
+                this->highPages[addr] = page;
+                return;
+            }
+            if (this->backing == SHADOW_REGIONS) {
+                return;
+            }
+
+            MidTable *&mid = this->root[number >> (MID_BITS + LEAF_BITS)];
+            if (mid == NULL) {
+                mid = (MidTable *) calloc(1, sizeof(MidTable));
+            }
+            LeafTable *&leaf = mid->leaves[(number >> LEAF_BITS) & ((1ULL << MID_BITS) - 1)];
+            if (leaf == NULL) {
+                leaf = (LeafTable *) calloc(1, sizeof(LeafTable));
+            }
+            leaf->pages[number & ((1ULL << LEAF_BITS) - 1)] = page;
+        }
+
+        // pages in shadow regions are released with their region
+        void deletePages() {
+            for (typename PageList::iterator iter = this->pages.begin(); iter != this->pages.end(); iter++) {
+                if (this->backing == SHADOW_REGIONS && (((*iter)->getAddress() >> T::BITS) >> PAGE_NUMBER_BITS) == 0) {
+                    (*iter)->~T();
+                } else {
+                    delete *iter;
+                }
+            }
+        }
+
+        void freeTables() {
+            for (uint64_t i = 0; i < (1ULL << ROOT_BITS); i++) {
+                MidTable *mid = this->root[i];
+                if (mid == NULL) continue;
+                for (uint64_t j = 0; j < (1ULL << MID_BITS); j++) {
+                    free(mid->leaves[j]);
+                }
+                free(mid);
+            }
+            memset(this->root, 0, sizeof(this->root));
+
+            for (uint64_t i = 0; i < (1ULL << ROOT_BITS); i++) {
+                RegionTable *table = this->regions[i];
+                if (table == NULL) continue;
+                for (uint64_t j = 0; j < (1ULL << MID_BITS); j++) {
+                    if (table->regions[j] != NULL) {
+                        munmap(table->regions[j], REGION_PAGES * sizeof(T));
+                    }
+                }
+                free(table);
+            }
+            memset(this->regions, 0, sizeof(this->regions));
+            this->highPages.clear();
+            this->lastAddr = 1;
+            this->lastPage = NULL;
+        }
 
     public:
-	MemoryMap() : pageMap() {}
+	MemoryMap(backing_t backing_type = HEAP_PAGES) : backing(backing_type), highPages(), pages(), lastAddr(1), lastPage(NULL) {
+            memset(this->root, 0, sizeof(this->root));
+            memset(this->regions, 0, sizeof(this->regions));
+        }
 
         virtual ~MemoryMap() {
-            for (typename PageMap::iterator iter = this->pageMap.begin(); iter != this->pageMap.end(); iter++) {
-		T *node = iter->second;
-                delete node;
-            }
+            deletePages();
+            freeTables();
         }
 
         void clear() {
-            for (typename PageMap::iterator iter = this->pageMap.begin(); iter != this->pageMap.end(); iter++) {
-		T *node = iter->second;
-                delete node;
-            }
-	    pageMap.clear();
+            deletePages();
+	    pages.clear();
+            freeTables();
 	}
 
+        size_t num_pages() const {
+            return this->pages.size();
+        }
+
         void clearPages() {
-            for (typename PageMap::iterator iter = this->pageMap.begin(); iter != this->pageMap.end(); iter++) {
-                iter->second->clear();
+            for (typename PageList::iterator iter = this->pages.begin(); iter != this->pages.end(); iter++) {
+                (*iter)->clear();
             }
         }
 
 	bool containsPage(const void * addr) {
-	    return (this->find(T::am_page_addr(addr)) != this->pageMap.end());
+	    return (this->getNode(addr) != NULL);
 	}
 
 	const T *getNode(const void *addr) const {
@@ -404,9 +700,13 @@ namespace Memory {
 	}
 
 	const T *getNode(const pageaddr_t &addr) const {
-	    typename PageMap::const_iterator iter = this->pageMap.find(addr);
-	    if (iter == this->pageMap.end()) return NULL;
-	    return iter->second;
+            if (addr == this->lastAddr) return this->lastPage;
+            T *page = findPage(addr);
+            if (page != NULL) {
+                this->lastAddr = addr;
+                this->lastPage = page;
+            }
+            return page;
 	}
 
 	T *getNode(const void *addr) {
@@ -414,17 +714,22 @@ namespace Memory {
 	}
 
 	T *getNode(const pageaddr_t &addr) {
-	    typename PageMap::iterator iter = this->pageMap.find(addr);
-	    if (iter == this->pageMap.end()) return NULL;
-	    return iter->second;
+            if (addr == this->lastAddr) return this->lastPage;
+            T *page = findPage(addr);
+            if (page != NULL) {
+                this->lastAddr = addr;
+                this->lastPage = page;
+            }
+            return page;
 	}
 
 	T *get_or_create_node(const void *addr) {
 	    pageaddr_t paddr = T::am_page_addr(addr);
 	    T *item = getNode(paddr);
 	    if (item == NULL) {
-                item = new T(paddr);
-                this->pageMap[paddr] = item;
+                item = createPage(paddr);
+                this->lastAddr = paddr;
+                this->lastPage = item;
 	    }
 	    return item;
 	}
@@ -449,6 +754,61 @@ namespace Memory {
 	    T *node = this->get_or_create_node(addr);
 	    node->template set_valid(addr, sizeof(S));
 	}
+
+        // Bulk versions for [addr, addr + n), which may span pages. Every
+        // page is updated a track word at a time.
+
+	bool is_range_valid(const void *addr, size_t n) const {
+            const char *current = (const char *) addr;
+            const char *end = current + n;
+            while (current < end) {
+                const size_t span = page_span(current, end);
+                const T *node = this->getNode(current);
+                if (node == NULL || !node->is_range_valid(current, span))
+                    return false;
+                current += span;
+            }
+            return true;
+	}
+
+	void set_range_valid(const void *addr, size_t n) {
+            const char *current = (const char *) addr;
+            const char *end = current + n;
+            while (current < end) {
+                const size_t span = page_span(current, end);
+                this->get_or_create_node(current)->set_range_valid(current, span);
+                current += span;
+            }
+	}
+
+	void set_range_invalid(const void *addr, size_t n) {
+            const char *current = (const char *) addr;
+            const char *end = current + n;
+            while (current < end) {
+                const size_t span = page_span(current, end);
+                this->get_or_create_node(current)->set_range_invalid(current, span);
+                current += span;
+            }
+	}
+
+	void clear_range(const void *addr, size_t n) {
+            const char *current = (const char *) addr;
+            const char *end = current + n;
+            while (current < end) {
+                const size_t span = page_span(current, end);
+                T *node = this->getNode(current);
+                if (node != NULL)
+                    node->clear_range(current, span);
+                current += span;
+            }
+	}
+
+    protected:
+        // Bytes from current to end or to the end of its page
+        static size_t page_span(const char *current, const char *end) {
+            const char *page_end = (const char *) (intptr_t) (T::am_page_addr(current) + (1ULL << T::BITS));
+            return ((page_end < end) ? page_end : end) - current;
+        }
     };
 
 
@@ -464,14 +824,14 @@ namespace Memory {
 	MemoryNodeMap &operator=(const MapType &map) {return *this;}
 
     public:
-	MemoryNodeMap() : MemoryMap<PageType>() {}
+	MemoryNodeMap(backing_t backing = HEAP_PAGES) : MemoryMap<PageType>(backing) {}
 
         virtual ~MemoryNodeMap() {}
 
 	template <class S>
 	const valid_t get_aligned_validity(const void * addr) const {
 	    PageType::check_addr_range(addr, sizeof(S));
-            if (this->pageMap.empty())
+            if (this->pages.empty())
                 return NONE;
 
 	    const PageType *node = this->getNode(addr);
@@ -559,147 +919,42 @@ namespace Memory {
 	    this->set_offset_valid(offset, sizeof(T));
 	}
 
-	void merge(const BytePage *node) {
-            uint64_t live_bytes = 0;
+        // Copies length bytes into the page and marks them valid, aborting
+        // like write_value if any of them was invalidated
+	void write_bytes(const void *addr, const uint8_t *bytes, uint32_t length) {
+	    this->check_range(addr, length);
+	    const uint32_t offset = this->am_offset(addr);
 
-	    for (uint64_t i = 0; i < sizeof(this->valid); i++) {
-                const uint64_t offset = i * 8;
-                for (uint64_t granule = offset; granule < offset + MemoryPage<uint8_t, PAGE_BITS>::TRACK_BITS_PER_INDEX ; granule++) {
-                    if (node->is_offset_valid(granule, 1)) {
-#ifdef MEMMAP_DEBUG
-                        fprintf(debug_log, "Writing %lx %lx %p\n", page_addr, granule, (void *) (intptr_t) (page_addr | granule) );
-#endif
-                        this->values[granule] = node->values[granule];
-                        this->set_offset_valid(granule, 1);
-                        live_bytes++;
-                    } else if (node->is_offset_invalid(granule, 1)) {
-                        if (this->is_offset_invalid(granule, 1)) {
-                            this->set_offset_unknown(granule, 1);
-                        } else {
-                            this->set_offset_invalid(granule, 1);
-                        }
-                    }
-                }
+            typename MemoryPage<uint8_t, PAGE_BITS>::AnyInvalid any = {this, false};
+            this->for_each_track(offset, length, any);
+            if (any.found) {
+                fprintf(stderr, "Attempt to write %u bytes over invalidated address %p\n", length, addr);
+                abort();
             }
-        }
 
-	void merge_old(const BytePage *node) {
-            uint64_t live_bytes = 0;
-
-	    for (uint64_t i = 0; i < sizeof(this->valid); i++) {
-                const uint8_t validity = node->valid[i];
-		this->valid[i] |= validity;
-                const uint64_t offset = i * 8;
+            memcpy(&this->values[offset], bytes, length);
+            this->set_range_valid(addr, length);
+	}
 
-                switch(validity) {
-                case 0:   // 0x00
+	void merge(const BytePage *node) {
+            const uint64_t bits = MemoryPage<uint8_t, PAGE_BITS>::TRACK_BITS_PER_INDEX;
+	    for (uint64_t i = 0; i < this->TRACK_SIZE; i++) {
+                const uint64_t node_valid = node->valid[i];
+                const uint64_t node_invalid = node->invalid[i] & ~node_valid;
+                if ((node_valid | node_invalid) == 0) {
                     continue;
-                    break;
-                case 15:  // 0x0f
-                    *((uint32_t *) &this->values[offset]) = *((uint32_t *) &node->values[offset]);
-                    break;
-                case 240: // 0xf0
-                    *((uint32_t *) &this->values[offset + 4]) = *((uint32_t *) &node->values[offset + 4]);
-                    break;
-                case 255: // 0xff
-                    *((uint64_t *) &this->values[offset]) = *((uint64_t *) &node->values[offset]);
-                    break;
-                default: 
-                    {
-                        for (uint64_t granule = offset; granule < offset + MemoryPage<uint8_t, PAGE_BITS>::TRACK_BITS_PER_INDEX ; granule++) {
-                            if (node->is_offset_valid(granule, 1)) {
-#ifdef MEMMAP_DEBUG
-                                fprintf(debug_log, "Writing %lx %lx %p\n", page_addr, granule, (void *) (intptr_t) (page_addr | granule) );
-#endif
-                                this->values[granule] = node->values[granule];
-                                live_bytes++;
-                            }
-                        }
-                    }
-                    break;
                 }
-            }
-        }
 
-
-        /* Untested */
-	void merge2(const BytePage *node) {
-            uint64_t live_bytes = 0;
-
-	    for (uint64_t i = 0; i < sizeof(this->valid); i++) {
-                const uint8_t validity = node->valid[i];
-		this->valid[i] |= validity;
-                const uint64_t offset = i * 8;
-
-                if (validity == 0) {
-                    continue;
-                } else if (validity == 0xff) {
-                    this->values[offset] = *((uint64_t *) &node->values[offset]);
-                } else {
-                    for (int j = 0; j < ((sizeof(validity) * 8) / 4); j++) {
-                        switch(validity & 0xf) {
-                        case 0:
-                            break;
-                        case 1:
-                            this->values[offset] = *((uint8_t *) &node->values[offset]);
-                            break;
-                        case 2:
-                            this->values[offset + 1] = *((uint8_t *) &node->values[offset + 1]);
-                            break;
-                        case 3:
-                            *((uint16_t *) this->values[offset]) = *((uint16_t *) &node->values[offset]);
-                            break;
-                        case 4:
-                            this->values[offset + 2] = *((uint8_t *) &node->values[offset + 2]);
-                            break;
-                        case 5:
-                            this->values[offset + 2] = *((uint8_t *) &node->values[offset + 2]);
-                            this->values[offset] = *((uint8_t *) &node->values[offset]);
-                            break;
-                        case 6:
-                            this->values[offset + 1] = *((uint8_t *) &node->values[offset + 1]);
-                            this->values[offset + 2] = *((uint8_t *) &node->values[offset + 2]);
-                            break;
-                        case 7:
-                            *((uint16_t *) this->values[offset]) = *((uint16_t *) &node->values[offset]);
-                            this->values[offset + 2] = *((uint8_t *) &node->values[offset + 2]);
-                            break;
-                        case 8:
-                            this->values[offset + 3] = *((uint8_t *) &node->values[offset + 3]);
-                            break;
-                        case 9:
-                            this->values[offset] = *((uint8_t *) &node->values[offset]);
-                            this->values[offset + 3] = *((uint8_t *) &node->values[offset + 3]);
-                            break;
-                        case 10:
-                            this->values[offset + 1] = *((uint8_t *) &node->values[offset + 1]);
-                            this->values[offset + 3] = *((uint8_t *) &node->values[offset + 3]);
-                            break;
-                        case 11:
-                            *((uint16_t *) this->values[offset]) = *((uint16_t *) &node->values[offset]);
-                            this->values[offset + 3] = *((uint8_t *) &node->values[offset + 3]);
-                            break;
-                        case 12:
-                            *((uint16_t *) this->values[offset + 2]) = *((uint16_t *) &node->values[offset + 2]);
-                            break;
-                        case 13:
-                            this->values[offset] = *((uint8_t *) &node->values[offset]);
-                            *((uint16_t *) this->values[offset + 2]) = *((uint16_t *) &node->values[offset + 2]);
-                            break;
-                        case 14:
-                            this->values[offset + 1] = *((uint8_t *) &node->values[offset + 1]);
-                            *((uint16_t *) this->values[offset + 2]) = *((uint16_t *) &node->values[offset + 2]);
-                            break;
-                        case 15:
-                             *((uint32_t *) this->values[offset]) = *((uint32_t *) &node->values[offset]);
-                            break;
-                        default:
-                            abort();
-                            break;
-                        }
-                        validity = validity>>4;
-                    }
+                const uint64_t offset = i * bits;
+                if (node_valid == ~0ULL) {
+                    memcpy(&this->values[offset], &node->values[offset], bits);
+                } else if (node_valid != 0) {
+                    blend_bytes(&this->values[offset], &node->values[offset], node_valid);
                 }
+
+                // Invalid bytes of node toggle: invalid twice is unknown
+                this->valid[i] = (this->valid[i] | node_valid) & ~node_invalid;
+                this->invalid[i] = (this->invalid[i] ^ node_invalid) & ~node_valid;
             }
         }
 
@@ -707,6 +962,10 @@ namespace Memory {
             const uint64_t addr = this->page_addr;
             bool wrote_something = false;
             for (uint64_t granule = 0; granule < this->PAGE_SIZE; granule++) {
+                if (this->valid[granule >> this->TRACK_SHIFT_OFFSET] == 0) {
+                    granule |= this->TRACK_BITS_PER_INDEX - 1;
+                    continue;
+                }
                 if (this->is_offset_valid(granule, 1)) {
                     uint8_t *maddr = (uint8_t *) (intptr_t) (addr | granule);
 #ifdef MEMMAP_DEBUG_BYTE
@@ -830,7 +1089,7 @@ namespace Memory {
 	MemoryValueMap &operator=(const MapType &map) {return *this;}
 
     public:
-	MemoryValueMap() : MemoryMap<PageType>() {}
+	MemoryValueMap(backing_t backing = HEAP_PAGES) : MemoryMap<PageType>(backing) {}
 
         virtual ~MemoryValueMap() {}
 
@@ -851,7 +1110,7 @@ namespace Memory {
 	    if (node == NULL) {
 		fprintf(stderr, "Illegal read\n");
 	    }
-	    return node->read_value<T>(addr);
+	    return node->template read_value<T>(addr);
 	}
 
 	template <class T>
@@ -877,7 +1136,7 @@ namespace Memory {
 	void write_aligned_value(void * addr, const T &value) {
 	    PageType::check_addr_range(addr, sizeof(T)); 
 	    PageType *node = this->get_or_create_node(addr);
-	    node->write_value<T>(addr, value);
+	    node->template write_value<T>(addr, value);
 	}
 
 	template <class T>
@@ -898,6 +1157,19 @@ namespace Memory {
 	    }
 	}
 
+        // Shadows a memcpy of n bytes from values to addr
+	void write_region(void *addr, const void *values, size_t n) {
+            const char *current = (const char *) addr;
+            const char *end = current + n;
+            const uint8_t *bytes = (const uint8_t *) values;
+            while (current < end) {
+                const size_t span = this->page_span(current, end);
+                this->get_or_create_node(current)->write_bytes(current, bytes, span);
+                current += span;
+                bytes += span;
+            }
+	}
+
 	template <class T>
 	T read_value_committed(const void * addr) const {
 	    if (!is_aligned<T>(addr)) {
@@ -909,12 +1181,12 @@ namespace Memory {
 		return *((const T *) addr);
 	    }
 
-	    return node->read_value_committed<T>(addr);
+	    return node->template read_value_committed<T>(addr);
 	}
 
 	void merge(const MapType *mm_version) {
-	    for (typename MemoryMap<BytePage<PAGE_BITS2> >::PageMap::const_iterator iter = mm_version->pageMap.begin(); iter != mm_version->pageMap.end(); iter++) {
-		const PageType *node = iter->second;
+	    for (typename MemoryMap<BytePage<PAGE_BITS2> >::PageList::const_iterator iter = mm_version->pages.begin(); iter != mm_version->pages.end(); iter++) {
+		const PageType *node = *iter;
                 const pageaddr_t addr = node->getAddress();
                 PageType *this_node = this->get_or_create_node((void *) addr);
 		this_node->merge(node);
@@ -924,8 +1196,8 @@ namespace Memory {
         void commit_to_main_memory() const {
             FILE *fp = debug_log;
 
-	    for (typename MemoryMap<BytePage<PAGE_BITS2> >::PageMap::const_iterator iter = this->pageMap.begin(); iter != this->pageMap.end(); iter++) {
-		const PageType *node = iter->second;
+	    for (typename MemoryMap<BytePage<PAGE_BITS2> >::PageList::const_iterator iter = this->pages.begin(); iter != this->pages.end(); iter++) {
+		const PageType *node = *iter;
 
 #ifdef MEMMAP_DEBUG
                 const uint32_t num_valid = node->print_valid_ranges(fp);
@@ -941,8 +1213,8 @@ namespace Memory {
 
         void print_valid_ranges() const {
             FILE *fp = debug_log;
-            for (typename MemoryMap<BytePage<PAGE_BITS2> >::PageMap::const_iterator iter = this->pageMap.begin(); iter != this->pageMap.end(); iter++) {
-		const PageType *node = iter->second;
+            for (typename MemoryMap<BytePage<PAGE_BITS2> >::PageList::const_iterator iter = this->pages.begin(); iter != this->pages.end(); iter++) {
+		const PageType *node = *iter;
 
                 const uint32_t num_valid = node->print_valid_ranges(fp);
                 if ((fp != NULL) && (num_valid > 0))
@@ -952,8 +1224,8 @@ namespace Memory {
 
 	bool are_values_correct() const {
             FILE *fp = debug_log;
-	    for (typename MemoryMap<BytePage<PAGE_BITS2> >::MapType::PageMap::const_iterator iter = this->pageMap.begin(); iter != this->pageMap.end(); iter++) {
-		const PageType *node = iter->second;
+	    for (typename MemoryMap<BytePage<PAGE_BITS2> >::PageList::const_iterator iter = this->pages.begin(); iter != this->pages.end(); iter++) {
+		const PageType *node = *iter;
 
 #ifdef MEMMAP_DEBUG
                 const uint32_t num_valid = node->print_valid_ranges(fp);
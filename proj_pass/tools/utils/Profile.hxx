@@ -8,6 +8,7 @@
 #include <map>
 #include <vector>
 #include <iterator>
+#include <algorithm>
 
 #include <ext/hash_set>
 
@@ -17,17 +18,9 @@ using namespace __gnu_cxx;
 
 namespace Profiling {
 
-  typedef struct ls_key_s {
-    uint32_t store;
-    uint32_t loop;
-  }  __attribute__((__packed__)) ls_key_t;
-
-  bool operator<(const ls_key_t &ls1, const ls_key_t&ls2) {
-    return *((uint32_t *) &ls1) < *((uint32_t *) &ls2);
-  }
-
-  static const uint64_t PROFILE_INSTR_MAX = ((1ULL << 16) - 1);
-  static const uint64_t PROFILE_LOOP_MAX = ((1ULL << 16) - 1);
+  // ~0U marks an unknown store or loop, every other 32 bit id is usable
+  static const uint64_t PROFILE_INSTR_MAX = ((1ULL << 32) - 2);
+  static const uint64_t PROFILE_LOOP_MAX = ((1ULL << 32) - 2);
 
   static const uint64_t DEFAULT_TRACKED_DISTANCE = 2;
 
@@ -69,28 +62,98 @@ namespace Profiling {
 
   typedef hash_set<Dependence, DependenceHash, DependenceEquals> DependenceSet;
 
+  // A (load, tracked distance, store, loop) tuple in two words, every
+  // field at the full width of Dependence so no id is ever truncated.
+  // Ordering the words orders by load, distance, store then loop.
+  class DependenceKey {
+    public:
+      uint64_t high;  // load << 32 | tracked distance
+      uint64_t low;   // store << 32 | loop
+
+      DependenceKey() : high(~0ULL), low(~0ULL) {}
+
+      DependenceKey(uint32_t load, uint32_t store, uint32_t loop, uint32_t dist)
+        : high(((uint64_t) load << 32) | dist), low(((uint64_t) store << 32) | loop) {}
+
+      // No load id is ~0U, so this never matches a dependence
+      bool isEmpty() const {return high == ~0ULL;}
+
+      uint32_t load() const {return (uint32_t) (high >> 32);}
+      uint32_t dist() const {return (uint32_t) high;}
+      uint32_t store() const {return (uint32_t) (low >> 32);}
+      uint32_t loop() const {return (uint32_t) low;}
+
+      uint64_t hash() const {
+        const uint64_t mixed = (high * 0x9E3779B97F4A7C15ULL) ^ (low * 0xC2B2AE3D27D4EB4FULL);
+        return mixed ^ (mixed >> 29);
+      }
+
+      bool operator==(const DependenceKey &key) const {
+        return (this->high == key.high) && (this->low == key.low);
+      }
+
+      bool operator!=(const DependenceKey &key) const {
+        return !(*this == key);
+      }
+
+      bool operator<(const DependenceKey &key) const {
+        return (this->high < key.high) || ((this->high == key.high) && (this->low < key.low));
+      }
+  };
+
   template <class T, int maxTrackedDistance = DEFAULT_TRACKED_DISTANCE>
     class KeyDistanceProfiler {
       public:
 
         static const uint64_t MAX_TRACKED_DISTANCE = maxTrackedDistance;
 
-        typedef map<ls_key_t, T> KeyProfilerMap;
-
-        typedef vector<KeyProfilerMap> DistanceMaps;
+        struct Entry {
+          DependenceKey key;
+          T profile;
+        };
 
-        typedef vector<DistanceMaps> InstructionMaps;
+        typedef vector<Entry> EntryTable;
 
       private:
-        InstructionMaps instructionInfo;
+        static const uint64_t INITIAL_CAPACITY = 1024;
 
-      public:
-        KeyDistanceProfiler(const uint32_t num_instrs) : instructionInfo(num_instrs){
-          if (sizeof(ls_key_t) != sizeof(uint64_t)) {
-            cerr<<"sizeof(ls_key_t) != sizeof(uint32_t) ("<<sizeof(ls_key_t)<<" != "<<sizeof(uint64_t)<<")"<<endl;
-            abort();
+        const uint32_t numInstrs;
+
+        // Open addressed with linear probing, at most half full
+        EntryTable entries;
+
+        uint64_t numEntries;
+
+        uint64_t slotMask;
+
+        uint64_t slot(const DependenceKey &key) const {
+          return key.hash() & slotMask;
+        }
+
+        void grow() {
+          EntryTable old(2 * entries.size());
+          old.swap(entries);
+          slotMask = entries.size() - 1;
+          for (typename EntryTable::iterator iter = old.begin(); iter != old.end(); iter++) {
+            if (iter->key.isEmpty())
+              continue;
+            uint64_t i = slot(iter->key);
+            while (!entries[i].key.isEmpty()) {
+              i = (i + 1) & slotMask;
+            }
+            entries[i] = *iter;
           }
+        }
+
+        struct EntryOrder {
+          bool operator()(const Entry *e1, const Entry *e2) const {
+            return e1->key < e2->key;
+          }
+        };
 
+      public:
+        KeyDistanceProfiler(const uint32_t num_instrs)
+          : numInstrs(num_instrs), entries(INITIAL_CAPACITY), numEntries(0), slotMask(INITIAL_CAPACITY - 1) {
           if (num_instrs > PROFILE_INSTR_MAX) {
             cerr<<"Number of instructions must be less than "<<PROFILE_INSTR_MAX<<" "<<num_instrs<<" given"<<endl;
             abort();
@@ -102,50 +165,55 @@ namespace Profiling {
           return tracked_distance;
         }
 
+        // The reference is good until the next getProfile
         T & getProfile(const Dependence &dep) {
-          DistanceMaps &distanceMap = instructionInfo.at(dep.load);
-
-          if (distanceMap.empty()) {
-            for (uint32_t i = 0; i < maxTrackedDistance; i++) {
-              distanceMap.push_back(KeyProfilerMap());
-            }
+          if (dep.load >= numInstrs) {
+            cerr<<"Load "<<dep.load<<" out of range, "<<numInstrs<<" instructions profiled"<<endl;
+            abort();
           }
 
-          const uint32_t tracked_distance = trackedDistance(dep.dist);
-
-          KeyProfilerMap &valueMap = distanceMap.at(tracked_distance);
-
-          const ls_key_t key = {dep.store, dep.loop};
-          if (valueMap.find(key) == valueMap.end()) {
-            T value_count;
-            valueMap[key] = value_count;
+          const DependenceKey key(dep.load, dep.store, dep.loop, trackedDistance(dep.dist));
+          uint64_t i = slot(key);
+          while (entries[i].key != key) {
+            if (entries[i].key.isEmpty()) {
+              if (2 * (numEntries + 1) > entries.size()) {
+                grow();
+                return getProfile(dep);
+              }
+              entries[i].key = key;
+              entries[i].profile = T();
+              numEntries++;
+              break;
+            }
+            i = (i + 1) & slotMask;
           }
-          T &profiler = valueMap[key];
-          return profiler;
+          return entries[i].profile;
         }
 
         template<class S, int D>
           friend ostream &operator<<(ostream &stream, const KeyDistanceProfiler<S, D> &vp);
     };
 
+  // Printed in key order: by load, distance, store then loop
   template<class T, int D>
     ostream &operator<<(ostream &stream, const KeyDistanceProfiler<T, D> &vp){
-      typename KeyDistanceProfiler<T, D>::InstructionMaps::const_iterator instrIter = vp.instructionInfo.begin();
-      for (; instrIter != vp.instructionInfo.end(); instrIter++) {
-        const uint32_t load = distance(vp.instructionInfo.begin(), instrIter);
-        typename KeyDistanceProfiler<T, D>::DistanceMaps::const_iterator distIter = instrIter->begin();
-        for (; distIter != instrIter->end(); distIter++) {
-          const uint32_t dist = distance(instrIter->begin(), distIter);
-          typename KeyDistanceProfiler<T, D>::KeyProfilerMap::const_iterator keyIter = distIter->begin();
-          for(; keyIter != distIter->end(); keyIter++) {
-            const ls_key_t key = keyIter->first;
-            const uint32_t loop = key.loop;
-            const uint32_t store = key.store;
-            const T &profile = (keyIter->second);
-
-            stream<<"("<<load<<" "<<dist<<" "<<loop<<" "<<store<<" ("<<profile<<") )"<<endl;
-          }
-        }
+      typedef typename KeyDistanceProfiler<T, D>::Entry Entry;
+      vector<const Entry *> sorted;
+      for (typename KeyDistanceProfiler<T, D>::EntryTable::const_iterator iter = vp.entries.begin(); iter != vp.entries.end(); iter++) {
+        if (!iter->key.isEmpty())
+          sorted.push_back(&(*iter));
+      }
+      sort(sorted.begin(), sorted.end(), typename KeyDistanceProfiler<T, D>::EntryOrder());
+
+      for (typename vector<const Entry *>::const_iterator iter = sorted.begin(); iter != sorted.end(); iter++) {
+        const DependenceKey &key = (*iter)->key;
+        const uint32_t load = key.load();
+        const uint32_t dist = key.dist();
+        const uint32_t loop = key.loop();
+        const uint32_t store = key.store();
+        const T &profile = (*iter)->profile;
+
+        stream<<"("<<load<<" "<<dist<<" "<<loop<<" "<<store<<" ("<<profile<<") )"<<endl;
       }
       return stream;
     }
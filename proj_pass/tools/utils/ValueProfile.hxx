@@ -11,47 +11,89 @@
 #include <vector>
 #include <iterator>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 using namespace std;
 
 namespace Profiling {
 
-  class ValueCount {
-    public:
-      uint64_t value;
-      uint64_t count;
-
-      ValueCount() : count(0) {}
-  };
-
-
+  // Up to MAX_VALUES frequent values of a dependence, found with one SIMD
+  // compare over the values array. When every slot is taken, a value that
+  // is not tracked decrements all the counts instead (Misra-Gries), and
+  // slots whose count reaches zero are free for the next new value. A
+  // value that becomes hot later therefore replaces a stale one, and the
+  // printed counts are lower bounds that are off by at most
+  // count / (MAX_VALUES + 1).
   class ValueProfile {
     private:
-      static const uint64_t MAX_VALUES = 5;
+      static const uint32_t MAX_VALUES = 8;
+
+      uint64_t values[MAX_VALUES];
+
+      uint64_t counts[MAX_VALUES];
 
-      ValueCount values[MAX_VALUES];
+      uint32_t occupied;  // bit i set while counts[i] != 0
 
       uint64_t count;
 
+      // Bit i set when values[i] == value, occupied or not
+      uint32_t match(const uint64_t value) const {
+#if defined(__AVX2__)
+        const __m256i key = _mm256_set1_epi64x(value);
+        const __m256i low = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *) &this->values[0]), key);
+        const __m256i high = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *) &this->values[4]), key);
+        return _mm256_movemask_pd(_mm256_castsi256_pd(low)) | (_mm256_movemask_pd(_mm256_castsi256_pd(high)) << 4);
+#elif defined(__SSE2__)
+        // SSE2 only compares 32 bit lanes, a 64 bit lane matches when both halves do
+        const __m128i key = _mm_set1_epi64x(value);
+        uint32_t bits = 0;
+        for (uint32_t i = 0; i < MAX_VALUES; i += 2) {
+          __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) &this->values[i]), key);
+          eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+          bits |= _mm_movemask_pd(_mm_castsi128_pd(eq)) << i;
+        }
+        return bits;
+#else
+        uint32_t bits = 0;
+        for (uint32_t i = 0; i < MAX_VALUES; i++) {
+          bits |= (this->values[i] == value) << i;
+        }
+        return bits;
+#endif
+      }
+
     public:
-      ValueProfile() : count(0) {
+      ValueProfile() : occupied(0), count(0) {
         memset(this->values, 0, sizeof(this->values));
+        memset(this->counts, 0, sizeof(this->counts));
       }
 
       void increment(const uint64_t value) {
         this->count++;
 
-        for (uint32_t i = 0; i < MAX_VALUES; i++) {
-          if (this->values[i].value == value) {
-            this->values[i].count++;
-            return;
-          }
+        const uint32_t hit = match(value) & this->occupied;
+        if (hit != 0) {
+          this->counts[__builtin_ctz(hit)]++;
+          return;
+        }
+
+        const uint32_t free_slots = ~this->occupied & ((1U << MAX_VALUES) - 1);
+        if (free_slots != 0) {
+          const uint32_t slot = __builtin_ctz(free_slots);
+          this->values[slot] = value;
+          this->counts[slot] = 1;
+          this->occupied |= (1U << slot);
+          return;
         }
 
         for (uint32_t i = 0; i < MAX_VALUES; i++) {
-          if (this->values[i].count == 0) {
-            this->values[i].value = value;
-            this->values[i].count = 1;
-            return;
+          this->counts[i]--;
+          if (this->counts[i] == 0) {
+            this->occupied &= ~(1U << i);
           }
         }
       }
@@ -65,8 +107,8 @@ namespace Profiling {
       return stream;
 
     for (uint32_t j = 0; j < ValueProfile::MAX_VALUES; j++) {
-      if (vp.values[j].count != 0) {
-        stream<<vp.values[j].value<<" "<<vp.values[j].count<<" : ";
+      if (vp.counts[j] != 0) {
+        stream<<vp.values[j]<<" "<<vp.counts[j]<<" : ";
       }
     }
 
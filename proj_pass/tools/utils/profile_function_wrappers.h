@@ -324,11 +324,93 @@ void memprof_perror(const char *s);
     exit(-1);
 
 
+/* With MEMPROF_COALESCE_REGIONS, a wrapper that reports many regions (the
+ * arguments of the printf and scanf families, the strings of argv) reports
+ * adjacent loads, and adjacent stores, as one interval. Regions are only
+ * held back between memprof_coalesce_begin() and memprof_coalesce_end(),
+ * which a wrapper pairs before it returns. Every event is therefore still
+ * reported during the library call that made it, in the includer's current
+ * context, and regions of different calls are never merged. A region that
+ * overlaps the other kind's pending interval flushes both first, so no
+ * dependence through a pending region is reordered.
+ */
+#ifdef MEMPROF_COALESCE_REGIONS
+typedef struct {
+    const char *start;
+    size_t length;
+} memprof_region;
+
+static memprof_region pending_load;
+static memprof_region pending_store;
+static unsigned int coalescing = 0;
+
+static int memprof_region_overlaps(const memprof_region *region, const char *ptr, size_t n) {
+    return (region->length != 0) && (ptr < region->start + region->length) && (region->start < ptr + n);
+}
+
+static void memprof_flush_load(void) {
+    if (pending_load.length != 0) {
+	LOAD(pending_load.start, pending_load.length);
+	pending_load.length = 0;
+    }
+}
+
+static void memprof_flush_store(void) {
+    if (pending_store.length != 0) {
+	STORE(pending_store.start, pending_store.length);
+	pending_store.length = 0;
+    }
+}
+
+static void memprof_flush_regions(void) {
+    memprof_flush_load();
+    memprof_flush_store();
+}
+
+static void memprof_pend_region(memprof_region *same, const memprof_region *other,
+                                void (*flush_same)(void), const char *ptr, size_t n) {
+    if (memprof_region_overlaps(other, ptr, n)) {
+	memprof_flush_regions();
+    }
+
+    if (same->length != 0 && ptr == same->start + same->length) {
+	same->length += n;
+	return;
+    }
+
+    flush_same();
+    same->start = ptr;
+    same->length = n;
+}
+
+static void memprof_coalesce_begin(void) {
+    coalescing++;
+}
+
+static void memprof_coalesce_end(void) {
+    if (--coalescing == 0) {
+	memprof_flush_regions();
+    }
+}
+#else
+static void memprof_coalesce_begin(void) {
+}
+
+static void memprof_coalesce_end(void) {
+}
+#endif
+
 static void memprof_load_region(const void *ptr, size_t n) {
     if (n == 0) {
 	return;
     }
 
+#ifdef MEMPROF_COALESCE_REGIONS
+    if (coalescing != 0) {
+	memprof_pend_region(&pending_load, &pending_store, memprof_flush_load, (const char *) ptr, n);
+	return;
+    }
+#endif
     LOAD(ptr, n);
 }
 
@@ -342,6 +424,12 @@ static void memprof_write_region(const void *dest, ssize_t n) {
 	return;
     }
 
+#ifdef MEMPROF_COALESCE_REGIONS
+    if (coalescing != 0) {
+	memprof_pend_region(&pending_store, &pending_load, memprof_flush_store, (const char *) dest, n);
+	return;
+    }
+#endif
     STORE(dest, n);
 }
 
@@ -1040,6 +1128,7 @@ static uint8_t is_long(const char *ptr) {
 /* MJB: We need to touch vp, if that is legal */
 static void touch_printf_args(const char *format, va_list vp) {
     char byte;
+    memprof_coalesce_begin();
     while ((byte = *format++) != '\0') {
 	if (byte != '%') {
 #ifdef LIBC_FUNC_DEBUG
@@ -1107,6 +1196,7 @@ static void touch_printf_args(const char *format, va_list vp) {
 	}
     }
 
+    memprof_coalesce_end();
     return;
 
  ERROR:
@@ -1192,6 +1282,7 @@ int memprof_vsnprintf(char *str, size_t size, const char *format, va_list ap) {
 static void touch_scanf_args(const char *format, va_list vp) {
     char byte;
     uint8_t ignore_store;
+    memprof_coalesce_begin();
 
     while ((byte = *format++) != '\0') {
 	ignore_store = 0;
@@ -1274,6 +1365,7 @@ static void touch_scanf_args(const char *format, va_list vp) {
 	}
     }
 
+    memprof_coalesce_end();
     return;
 
  ERROR:
@@ -1971,11 +2063,13 @@ long memprof___sysconf(int name) {
 int memprof_getopt(int argc, char * const argv[], const char *optstring) {
     int i = 0;
 
+    memprof_coalesce_begin();
     memprof_load_string(optstring);
     while (argv[i] != NULL) {
 	    memprof_load_string(argv[i]);
         i++;
     }
+    memprof_coalesce_end();
 
     return getopt(argc, argv, optstring);
 }